@@ -35,13 +35,21 @@ Args::Args() {
   label = "__label__";
   verbose = 2;
   pretrainedVectors = "";
+  labels = "";
   saveOutput = 0;
+  compress = 0;
+  outputRank = 0;
+  profile = 0;
+  sharedNeg = 0;
+  memoryBudget = 0;
 
   qout = false;
   retrain = false;
   qnorm = false;
   cutoff = 0;
   dsub = 2;
+  qbatch = 0;
+  rdsub = 0;
 }
 
 std::string Args::lossToString(loss_name ln) {
@@ -131,8 +139,20 @@ void Args::parseArgs(const std::vector<std::string>& args) {
       verbose = std::stoi(args[ai + 1]);
     } else if (args[ai] == "-pretrainedVectors") {
       pretrainedVectors = std::string(args[ai + 1]);
+    } else if (args[ai] == "-labels") {
+      labels = std::string(args[ai + 1]);
     } else if (args[ai] == "-saveOutput") {
       saveOutput = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-compress") {
+      compress = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-outputRank") {
+      outputRank = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-profile") {
+      profile = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-sharedNeg") {
+      sharedNeg = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-memoryBudget") {
+      memoryBudget = std::stoi(args[ai + 1]);
     } else if (args[ai] == "-qnorm") {
       qnorm = true; ai--;
     } else if (args[ai] == "-retrain") {
@@ -143,6 +163,10 @@ void Args::parseArgs(const std::vector<std::string>& args) {
     cutoff = std::stoi(args[ai + 1]);
     } else if (args[ai] == "-dsub") {
       dsub = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-rdsub") {
+      rdsub = std::stoi(args[ai + 1]);
+    } else if (args[ai] == "-qbatch") {
+      qbatch = std::stoi(args[ai + 1]);
     } else {
       std::cerr << "Unknown argument: " << args[ai] << std::endl;
       printHelp();
@@ -155,7 +179,47 @@ void Args::parseArgs(const std::vector<std::string>& args) {
     printHelp();
     exit(EXIT_FAILURE);
   }
-  if (wordNgrams <= 1 && maxn == 0) {
+  if (!labels.empty() &&
+      (model != model_name::sup || !pretrainedVectors.empty())) {
+    std::cerr << "-labels is only supported for supervised models "
+              << "without pretrained vectors." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (!labels.empty() && bucket <= 0) {
+    std::cerr << "-labels hashes the words into buckets, "
+              << "-bucket should be positive." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (outputRank < 0 || outputRank > dim) {
+    std::cerr << "-outputRank should be between 0 and dim." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (sharedNeg > 0 &&
+      (model != model_name::sg || loss != loss_name::ns)) {
+    std::cerr << "-sharedNeg is only supported for skipgram models "
+              << "with negative sampling." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (memoryBudget < 0) {
+    std::cerr << "-memoryBudget should be non-negative." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (profile < 0) {
+    std::cerr << "-profile should be non-negative." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (compress < 0 || compress > 9) {
+    std::cerr << "-compress should be between 0 and 9." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+#ifndef FASTTEXT_USE_ZLIB
+  if (compress > 0) {
+    std::cerr << "fastText was built without compression support "
+              << "(rebuild with ZLIB=1)." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+#endif
+  if (wordNgrams <= 1 && maxn == 0 && labels.empty()) {
     bucket = 0;
   }
 }
@@ -187,7 +251,9 @@ void Args::printDictionaryHelp() {
     << "  -minn               min length of char ngram [" << minn << "]\n"
     << "  -maxn               max length of char ngram [" << maxn << "]\n"
     << "  -t                  sampling threshold [" << t << "]\n"
-    << "  -label              labels prefix [" << label << "]\n";
+    << "  -label              labels prefix [" << label << "]\n"
+    << "  -labels             file of labels, words are then hashed into buckets without a dictionary [" << labels << "]\n"
+    << "  -memoryBudget       memory for training in MB, raises minCount and lowers bucket to fit, 0 for no limit [" << memoryBudget << "]\n";
 }
 
 void Args::printTrainingHelp() {
@@ -202,7 +268,11 @@ void Args::printTrainingHelp() {
     << "  -loss               loss function {ns, hs, softmax} [" << lossToString(loss) << "]\n"
     << "  -thread             number of threads [" << thread << "]\n"
     << "  -pretrainedVectors  pretrained word vectors for supervised learning ["<< pretrainedVectors <<"]\n"
-    << "  -saveOutput         whether output params should be saved [" << saveOutput << "]\n";
+    << "  -saveOutput         whether output params should be saved [" << saveOutput << "]\n"
+    << "  -compress           compression level of the saved matrices, 0 to disable [" << compress << "]\n"
+    << "  -outputRank         rank of the factorized output layer, 0 for a full matrix [" << outputRank << "]\n"
+    << "  -profile            record row accesses of one update out of N, 0 to disable [" << profile << "]\n"
+    << "  -sharedNeg          whether skipgram shares the negatives of a window [" << sharedNeg << "]\n";
 }
 
 void Args::printQuantizationHelp() {
@@ -212,7 +282,9 @@ void Args::printQuantizationHelp() {
     << "  -retrain            finetune embeddings if a cutoff is applied [" << retrain << "]\n"
     << "  -qnorm              quantizing the norm separately [" << qnorm << "]\n"
     << "  -qout               quantizing the classifier [" << qout << "]\n"
-    << "  -dsub               size of each sub-vector [" << dsub << "]\n";
+    << "  -dsub               size of each sub-vector [" << dsub << "]\n"
+    << "  -rdsub              size of each residual sub-vector, 0 to disable [" << rdsub << "]\n"
+    << "  -qbatch             mini-batch size for k-means, 0 for full batch [" << qbatch << "]\n";
 }
 
 void Args::save(std::ostream& out) {
@@ -48,13 +48,21 @@ class Args {
     std::string label;
     int verbose;
     std::string pretrainedVectors;
+    std::string labels;
     int saveOutput;
+    int compress;
+    int outputRank;
+    int profile;
+    int sharedNeg;
+    int memoryBudget;
 
     bool qout;
     bool retrain;
     bool qnorm;
     size_t cutoff;
     size_t dsub;
+    int qbatch;
+    size_t rdsub;
 
     void parseArgs(const std::vector<std::string>& args);
     void printHelp();
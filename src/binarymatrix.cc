@@ -0,0 +1,154 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "binarymatrix.h"
+
+#include <assert.h>
+#include <cmath>
+#include <random>
+
+namespace fasttext {
+
+BinaryMatrix::BinaryMatrix() : m_(0), n_(0), nbits_(0), nwords_(0) {}
+
+// Codes of m rows of dimension n. The projections are gaussian. When there
+// are no more bits than dimensions they are orthonormalized, which makes
+// them a rotation.
+BinaryMatrix::BinaryMatrix(int64_t m, int64_t n, int32_t nbits, int32_t seed)
+    : m_(m), n_(n), nbits_(nbits), nwords_((nbits + 63) / 64) {
+  assert(nbits > 0);
+  std::minstd_rand rng(seed);
+  std::normal_distribution<> normal(0, 1);
+  rotation_.resize(nbits_ * n_);
+  for (int64_t i = 0; i < rotation_.size(); i++) {
+    rotation_[i] = normal(rng);
+  }
+  if (nbits_ <= n_) {
+    for (int32_t i = 0; i < nbits_; i++) {
+      real* ri = rotation_.data() + i * n_;
+      for (int32_t j = 0; j < i; j++) {
+        const real* rj = rotation_.data() + j * n_;
+        real d = 0.0;
+        for (int64_t l = 0; l < n_; l++) {
+          d += ri[l] * rj[l];
+        }
+        for (int64_t l = 0; l < n_; l++) {
+          ri[l] -= d * rj[l];
+        }
+      }
+      real norm = 0.0;
+      for (int64_t l = 0; l < n_; l++) {
+        norm += ri[l] * ri[l];
+      }
+      norm = std::sqrt(norm);
+      for (int64_t l = 0; l < n_; l++) {
+        ri[l] /= norm;
+      }
+    }
+  }
+  codes_.assign(m_ * nwords_, 0);
+}
+
+int64_t BinaryMatrix::getM() const {
+  return m_;
+}
+
+int64_t BinaryMatrix::getN() const {
+  return n_;
+}
+
+int32_t BinaryMatrix::getNBits() const {
+  return nbits_;
+}
+
+int64_t BinaryMatrix::size() const {
+  return codes_.size() * sizeof(uint64_t);
+}
+
+void BinaryMatrix::encode(const Vector& vec, uint64_t* code) const {
+  assert(vec.size() == n_);
+  for (int32_t w = 0; w < nwords_; w++) {
+    code[w] = 0;
+  }
+  for (int32_t i = 0; i < nbits_; i++) {
+    const real* r = rotation_.data() + i * n_;
+    real d = 0.0;
+    for (int64_t l = 0; l < n_; l++) {
+      d += r[l] * vec[l];
+    }
+    if (d > 0) {
+      code[i / 64] |= uint64_t(1) << (i % 64);
+    }
+  }
+}
+
+void BinaryMatrix::setRow(int64_t i, const Vector& vec) {
+  assert(i >= 0 && i < m_);
+  encode(vec, codes_.data() + i * nwords_);
+}
+
+int32_t BinaryMatrix::distance(const uint64_t* code, int64_t i) const {
+  const uint64_t* row = codes_.data() + i * nwords_;
+  int32_t d = 0;
+  for (int32_t w = 0; w < nwords_; w++) {
+    d += __builtin_popcountll(code[w] ^ row[w]);
+  }
+  return d;
+}
+
+// Returns the n rows closest to the query in Hamming distance. Distances
+// are bounded by the number of bits, so a histogram gives the cutoff
+// distance without sorting the rows.
+void BinaryMatrix::search(const Vector& query, int32_t n,
+                          std::vector<int64_t>& rows) const {
+  std::vector<uint64_t> code(nwords_);
+  encode(query, code.data());
+  std::vector<int32_t> distances(m_);
+  std::vector<int64_t> counts(nbits_ + 1, 0);
+  for (int64_t i = 0; i < m_; i++) {
+    distances[i] = distance(code.data(), i);
+    counts[distances[i]]++;
+  }
+  int32_t cutoff = 0;
+  int64_t total = counts[0];
+  while (total < n && cutoff < nbits_) {
+    total += counts[++cutoff];
+  }
+  int64_t remaining = n - (total - counts[cutoff]);
+  rows.clear();
+  for (int64_t i = 0; i < m_; i++) {
+    if (distances[i] < cutoff) {
+      rows.push_back(i);
+    } else if (distances[i] == cutoff && remaining > 0) {
+      rows.push_back(i);
+      remaining--;
+    }
+  }
+}
+
+void BinaryMatrix::save(std::ostream& out) {
+  out.write((char*) &m_, sizeof(m_));
+  out.write((char*) &n_, sizeof(n_));
+  out.write((char*) &nbits_, sizeof(nbits_));
+  out.write((char*) rotation_.data(), rotation_.size() * sizeof(real));
+  out.write((char*) codes_.data(), codes_.size() * sizeof(uint64_t));
+}
+
+void BinaryMatrix::load(std::istream& in) {
+  in.read((char*) &m_, sizeof(m_));
+  in.read((char*) &n_, sizeof(n_));
+  in.read((char*) &nbits_, sizeof(nbits_));
+  nwords_ = (nbits_ + 63) / 64;
+  rotation_.resize(nbits_ * n_);
+  in.read((char*) rotation_.data(), rotation_.size() * sizeof(real));
+  codes_.resize(m_ * nwords_);
+  in.read((char*) codes_.data(), codes_.size() * sizeof(uint64_t));
+}
+
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#ifndef FASTTEXT_BINARYMATRIX_H
+#define FASTTEXT_BINARYMATRIX_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "real.h"
+
+#include "vector.h"
+
+namespace fasttext {
+
+// One bit per dimension of a random rotation of a set of vectors, which
+// are encoded one row at a time. Rows are compared with the Hamming
+// distance between their codes.
+class BinaryMatrix {
+  private:
+    std::vector<real> rotation_;
+    std::vector<uint64_t> codes_;
+
+    int64_t m_;
+    int64_t n_;
+
+    int32_t nbits_;
+    int32_t nwords_;
+
+  public:
+
+    BinaryMatrix();
+    BinaryMatrix(int64_t, int64_t, int32_t, int32_t);
+
+    int64_t getM() const;
+    int64_t getN() const;
+    int32_t getNBits() const;
+    int64_t size() const;
+
+    void encode(const Vector&, uint64_t*) const;
+    void setRow(int64_t, const Vector&);
+    int32_t distance(const uint64_t*, int64_t) const;
+    void search(const Vector&, int32_t, std::vector<int64_t>&) const;
+
+    void save(std::ostream&);
+    void load(std::istream&);
+};
+
+}
+
+#endif
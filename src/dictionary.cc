@@ -17,6 +17,10 @@
 #include <iterator>
 #include <cmath>
 
+#include "model.h"
+#include "threadpool.h"
+#include "utils.h"
+
 namespace fasttext {
 
 const std::string Dictionary::EOS = "</s>";
@@ -25,7 +29,7 @@ const std::string Dictionary::EOW = ">";
 
 Dictionary::Dictionary(std::shared_ptr<Args> args) : args_(args),
   word2int_(MAX_VOCAB_SIZE, -1), size_(0), nwords_(0), nlabels_(0),
-  ntokens_(0) {}
+  ntokens_(0), hashWords_(false) {}
 
 int32_t Dictionary::find(const std::string& w) const {
   return find(w, hash(w));
@@ -79,6 +83,12 @@ const std::vector<int32_t> Dictionary::getSubwords(
     return getSubwords(i);
   }
   std::vector<int32_t> ngrams;
+  if (hashWords_ && getType(word) == entry_type::word) {
+    int32_t id = getHashId(hash(word));
+    if (id >= 0) {
+      ngrams.push_back(id);
+    }
+  }
   computeSubwords(BOW + word + EOW, ngrams);
   return ngrams;
 }
@@ -180,11 +190,15 @@ void Dictionary::computeSubwords(const std::string& word,
 }
 
 void Dictionary::initNgrams() {
-  for (size_t i = 0; i < size_; i++) {
-    std::string word = BOW + words_[i].word + EOW;
-    words_[i].subwords.push_back(i);
-    computeSubwords(word, words_[i].subwords);
-  }
+  ThreadPool::global()->parallelFor(0, size_, [this](int64_t begin,
+                                                     int64_t end) {
+    for (int32_t i = begin; i < end; i++) {
+      std::string word = BOW + words_[i].word + EOW;
+      words_[i].subwords.clear();
+      words_[i].subwords.push_back(i);
+      computeSubwords(word, words_[i].subwords);
+    }
+  }, 1024);
 }
 
 bool Dictionary::readWord(std::istream& in, std::string& word) const
@@ -228,6 +242,9 @@ void Dictionary::readFromFile(std::istream& in) {
     }
   }
   threshold(args_->minCount, args_->minCountLabel);
+  if (args_->memoryBudget > 0) {
+    fitMemoryBudget();
+  }
   initTableDiscard();
   initNgrams();
   if (args_->verbose > 0) {
@@ -242,6 +259,166 @@ void Dictionary::readFromFile(std::istream& in) {
   }
 }
 
+// Dictionary-free mode for supervised models: only the declared labels
+// are stored, and words are hashed into the buckets like word n-grams.
+// The label counts and the number of tokens are extrapolated from the
+// beginning of the input, so that training can start right away.
+void Dictionary::initHashing(std::istream& labels, std::ifstream& in) {
+  std::string word;
+  while (readWord(labels, word)) {
+    if (word == EOS) continue;
+    if (getType(word) != entry_type::label) {
+      std::cerr << "Declared label " << word << " does not start with "
+                << args_->label << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    add(word);
+  }
+  if (size_ == 0) {
+    std::cerr << "Empty set of labels." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  nwords_ = 0;
+  nlabels_ = size_;
+  ntokens_ = 0;
+  hashWords_ = true;
+
+  const int64_t size = utils::size(in);
+  utils::seek(in, 0);
+  int64_t read = 0;
+  while (read < HASHING_SAMPLE_SIZE && readWord(in, word)) {
+    read += word.size() + 1;
+    ntokens_++;
+    int32_t id = getId(word);
+    if (id >= 0) {
+      words_[id].count++;
+    }
+  }
+  if (read > 0 && read < size) {
+    real scale = real(size) / real(read);
+    ntokens_ = ntokens_ * scale;
+    for (auto it = words_.begin(); it != words_.end(); ++it) {
+      it->count = it->count * scale;
+    }
+  }
+  initTableDiscard();
+  initNgrams();
+  if (args_->verbose > 0) {
+    std::cerr << "Estimated words: " << ntokens_ << std::endl;
+    std::cerr << "Number of labels: " << nlabels_ << std::endl;
+  }
+}
+
+bool Dictionary::hashWords() const {
+  return hashWords_;
+}
+
+void Dictionary::setHashWords(bool hashWords) {
+  hashWords_ = hashWords;
+}
+
+// Number of character n-grams computeSubwords finds in a word.
+int64_t Dictionary::countSubwords(const std::string& word) const {
+  if (args_->maxn <= 0) {
+    return 0;
+  }
+  int64_t nchars = 2;
+  for (size_t i = 0; i < word.size(); i++) {
+    if ((word[i] & 0xC0) != 0x80) nchars++;
+  }
+  int64_t count = 0;
+  for (int64_t n = std::max(args_->minn, 1); n <= args_->maxn; n++) {
+    count += std::max(int64_t(0), nchars - n + 1);
+  }
+  if (args_->minn <= 1) {
+    count -= 2;
+  }
+  return std::max(int64_t(0), count);
+}
+
+// Keeps the most frequent words, and a number of buckets proportional to
+// them, such that the dictionary, the matrices and the tables of the
+// training threads fit in -memoryBudget. The words are sorted by decreasing
+// count after threshold, so the vocabulary is cut with a higher minCount.
+void Dictionary::fitMemoryBudget() {
+  const int64_t budget = int64_t(args_->memoryBudget) << 20;
+  const int64_t dim = args_->dim;
+  const int64_t odim = args_->outputRank > 0 ? args_->outputRank : dim;
+  const int64_t bucket = args_->bucket;
+  const int64_t nwords = nwords_;
+  const int64_t nmodels = args_->thread + 1;
+
+  std::vector<int64_t> wordSize(nwords + 1, 0);
+  int64_t fixedSize = MAX_VOCAB_SIZE * sizeof(int32_t);
+  for (int32_t i = 0; i < size_; i++) {
+    const entry& e = words_[i];
+    int64_t size = sizeof(entry) + sizeof(real) +
+                   (1 + countSubwords(e.word)) * sizeof(int32_t);
+    if (e.word.size() >= sizeof(std::string)) {
+      size += e.word.size() + 1;
+    }
+    if (e.type == entry_type::word) {
+      wordSize[i + 1] = wordSize[i] + size;
+    } else {
+      fixedSize += size;
+    }
+  }
+  if (args_->outputRank > 0) {
+    fixedSize += args_->outputRank * dim * sizeof(real);
+  }
+
+  auto bucketsFor = [&](int64_t n) -> int64_t {
+    if (bucket == 0 || nwords == 0) return bucket;
+    return std::max(int64_t(1), bucket * n / nwords);
+  };
+  std::vector<int64_t> parts(4);
+  auto memoryFor = [&](int64_t n, int64_t buckets) -> int64_t {
+    int32_t osz = args_->model == model_name::sup ? nlabels_ : n;
+    parts[0] = fixedSize + wordSize[n];
+    parts[1] = (n + buckets) * dim * sizeof(real);
+    parts[2] = osz * odim * sizeof(real);
+    parts[3] = nmodels * Model::memoryUsage(*args_, osz);
+    return parts[0] + parts[1] + parts[2] + parts[3];
+  };
+
+  if (memoryFor(0, bucketsFor(0)) > budget) {
+    std::cerr << "The memory budget is too small for this model: at least "
+              << (memoryFor(0, bucketsFor(0)) >> 20) << "MB are needed."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  int64_t lo = 0, hi = nwords;
+  while (lo < hi) {
+    int64_t mid = (lo + hi + 1) / 2;
+    if (memoryFor(mid, bucketsFor(mid)) <= budget) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  if (lo < nwords) {
+    args_->minCount = words_[lo].count + 1;
+    args_->bucket = bucketsFor(lo);
+    threshold(args_->minCount, args_->minCountLabel);
+  }
+
+  memoryFor(nwords_, args_->bucket);
+  if (args_->verbose > 0) {
+    std::cerr << "Memory budget: " << args_->memoryBudget << "MB"
+              << ", minCount: " << args_->minCount
+              << ", bucket: " << args_->bucket << std::endl;
+    const char* names[] = {"dictionary", "input matrix", "output matrix",
+                           "thread tables"};
+    for (int32_t i = 0; i < 4; i++) {
+      std::cerr << "  " << names[i] << ": " << (parts[i] >> 20) << "MB"
+                << std::endl;
+    }
+    std::cerr << "  total: "
+              << ((parts[0] + parts[1] + parts[2] + parts[3]) >> 20) << "MB"
+              << std::endl;
+  }
+}
+
 void Dictionary::threshold(int64_t t, int64_t tl) {
   sort(words_.begin(), words_.end(), [](const entry& e1, const entry& e2) {
       if (e1.type != e2.type) return e1.type < e2.type;
@@ -280,6 +457,20 @@ std::vector<int64_t> Dictionary::getCounts(entry_type type) const {
   return counts;
 }
 
+// Returns the row of the bucket of a hash, or -1 if it was pruned.
+int32_t Dictionary::getHashId(uint64_t h) const {
+  if (pruneidx_size_ == 0) return -1;
+  int64_t id = h % args_->bucket;
+  if (pruneidx_size_ > 0) {
+    if (pruneidx_.count(id)) {
+      id = pruneidx_.at(id);
+    } else {
+      return -1;
+    }
+  }
+  return nwords_ + id;
+}
+
 void Dictionary::addWordNgrams(std::vector<int32_t>& line,
                            const std::vector<int32_t>& hashes,
                            int32_t n) const {
@@ -288,17 +479,23 @@ void Dictionary::addWordNgrams(std::vector<int32_t>& line,
     uint64_t h = hashes[i];
     for (int32_t j = i + 1; j < hashes.size() && j < i + n; j++) {
       h = h * 116049371 + hashes[j];
-      int64_t id = h % args_->bucket;
-      if (pruneidx_size_ > 0) {
-        if (pruneidx_.count(id)) {
-          id = pruneidx_.at(id);
-        } else {continue;}
+      int32_t id = getHashId(h);
+      if (id >= 0) {
+        line.push_back(id);
       }
-      line.push_back(nwords_ + id);
     }
   }
 }
 
+int32_t Dictionary::getWordNgram(const std::vector<int32_t>& hashes,
+                                 int32_t i, int32_t n) const {
+  uint64_t h = hashes[i];
+  for (int32_t j = i + 1; j < i + n; j++) {
+    h = h * 116049371 + hashes[j];
+  }
+  return getHashId(h);
+}
+
 int32_t Dictionary::getLine(std::istream& in,
                             std::vector<int32_t>& words,
                             std::vector<int32_t>& word_hashes,
@@ -322,6 +519,14 @@ int32_t Dictionary::getLine(std::istream& in,
     if (wid < 0) {
       entry_type type = getType(token);
       if (type == entry_type::word) word_hashes.push_back(h);
+      if (hashWords_ && type == entry_type::word) {
+        ntokens++;
+        int32_t id = getHashId(h);
+        if (id >= 0) {
+          words.push_back(id);
+        }
+        if (token == EOS) break;
+      }
       continue;
     }
     entry_type type = getType(wid);
@@ -352,6 +557,69 @@ int32_t Dictionary::getLine(std::istream& in,
   return ntokens;
 }
 
+// Reads up to n lines of a supervised input at once, fewer only at the
+// end of the input. Callers serving interactive input ask for one line at
+// a time. Lookups are done in stages over all the tokens of the batch: the hash
+// table slots are prefetched first, then the entries they point to, so
+// that the cache misses of different tokens overlap.
+int32_t Dictionary::getLines(std::istream& in, int32_t n,
+                             std::vector<std::vector<int32_t>>& words,
+                             std::vector<std::vector<int32_t>>& labels) const {
+  std::vector<std::string> tokens;
+  std::vector<uint32_t> hashes;
+  std::vector<size_t> ends;
+  std::string token;
+  while (ends.size() < n) {
+    size_t begin = tokens.size();
+    while (readWord(in, token)) {
+      uint32_t h = hash(token);
+      __builtin_prefetch(&word2int_[h % MAX_VOCAB_SIZE]);
+      tokens.push_back(token);
+      hashes.push_back(h);
+      if (token == EOS) break;
+    }
+    if (tokens.size() == begin) break;
+    ends.push_back(tokens.size());
+  }
+  for (size_t i = 0; i < tokens.size(); i++) {
+    int32_t id = word2int_[hashes[i] % MAX_VOCAB_SIZE];
+    if (id >= 0) {
+      __builtin_prefetch(&words_[id]);
+    }
+  }
+  words.resize(ends.size());
+  labels.resize(ends.size());
+  std::vector<int32_t> word_hashes;
+  for (size_t l = 0, i = 0; l < ends.size(); l++) {
+    words[l].clear();
+    labels[l].clear();
+    word_hashes.clear();
+    for (; i < ends[l]; i++) {
+      int32_t wid = getId(tokens[i], hashes[i]);
+      if (wid < 0) {
+        if (getType(tokens[i]) == entry_type::word) {
+          word_hashes.push_back(hashes[i]);
+          int32_t id = hashWords_ ? getHashId(hashes[i]) : -1;
+          if (id >= 0) {
+            words[l].push_back(id);
+          }
+        }
+        continue;
+      }
+      entry_type type = getType(wid);
+      if (type == entry_type::word) {
+        words[l].push_back(wid);
+        word_hashes.push_back(hashes[i]);
+      }
+      if (type == entry_type::label) {
+        labels[l].push_back(wid - nwords_);
+      }
+    }
+    addWordNgrams(words[l], word_hashes, args_->wordNgrams);
+  }
+  return ends.size();
+}
+
 std::string Dictionary::getLabel(int32_t lid) const {
   assert(lid >= 0);
   assert(lid < nlabels_);
@@ -378,6 +646,11 @@ void Dictionary::save(std::ostream& out) const {
 }
 
 void Dictionary::load(std::istream& in) {
+  loadEntries(in);
+  initTables();
+}
+
+void Dictionary::loadEntries(std::istream& in) {
   words_.clear();
   std::fill(word2int_.begin(), word2int_.end(), -1);
   in.read((char*) &size_, sizeof(int32_t));
@@ -385,12 +658,10 @@ void Dictionary::load(std::istream& in) {
   in.read((char*) &nlabels_, sizeof(int32_t));
   in.read((char*) &ntokens_, sizeof(int64_t));
   in.read((char*) &pruneidx_size_, sizeof(int64_t));
+  words_.reserve(size_);
   for (int32_t i = 0; i < size_; i++) {
-    char c;
     entry e;
-    while ((c = in.get()) != 0) {
-      e.word.push_back(c);
-    }
+    std::getline(in, e.word, '\0');
     in.read((char*) &e.count, sizeof(int64_t));
     in.read((char*) &e.type, sizeof(entry_type));
     words_.push_back(e);
@@ -404,6 +675,9 @@ void Dictionary::load(std::istream& in) {
     in.read((char*) &second, sizeof(int32_t));
     pruneidx_[first] = second;
   }
+}
+
+void Dictionary::initTables() {
   initTableDiscard();
   initNgrams();
 }
@@ -13,6 +13,7 @@
 #include <vector>
 #include <string>
 #include <istream>
+#include <fstream>
 #include <ostream>
 #include <random>
 #include <memory>
@@ -37,11 +38,15 @@ class Dictionary {
   private:
     static const int32_t MAX_VOCAB_SIZE = 30000000;
     static const int32_t MAX_LINE_SIZE = 1024;
+    static const int64_t HASHING_SAMPLE_SIZE = 1 << 24;
 
     int32_t find(const std::string&) const;
     int32_t find(const std::string&, uint32_t h) const;
     void initTableDiscard();
     void initNgrams();
+    int32_t getHashId(uint64_t) const;
+    int64_t countSubwords(const std::string&) const;
+    void fitMemoryBudget();
 
     std::shared_ptr<Args> args_;
     std::vector<int32_t> word2int_;
@@ -52,6 +57,7 @@ class Dictionary {
     int32_t nwords_;
     int32_t nlabels_;
     int64_t ntokens_;
+    bool hashWords_;
 
     int64_t pruneidx_size_ = -1;
     std::unordered_map<int32_t, int32_t> pruneidx_;
@@ -88,17 +94,26 @@ class Dictionary {
         std::vector<int32_t>&,
         std::vector<std::string>&) const;
     uint32_t hash(const std::string& str) const;
+    int32_t getWordNgram(const std::vector<int32_t>&, int32_t, int32_t) const;
     void add(const std::string&);
     bool readWord(std::istream&, std::string&) const;
     void readFromFile(std::istream&);
+    void initHashing(std::istream&, std::ifstream&);
+    bool hashWords() const;
+    void setHashWords(bool);
     std::string getLabel(int32_t) const;
     void save(std::ostream&) const;
     void load(std::istream&);
+    void loadEntries(std::istream&);
+    void initTables();
     std::vector<int64_t> getCounts(entry_type) const;
     int32_t getLine(std::istream&, std::vector<int32_t>&, std::vector<int32_t>&,
                     std::vector<int32_t>&, std::minstd_rand&) const;
     int32_t getLine(std::istream&, std::vector<int32_t>&,
                     std::vector<int32_t>&, std::minstd_rand&) const;
+    int32_t getLines(std::istream&, int32_t,
+                     std::vector<std::vector<int32_t>>&,
+                     std::vector<std::vector<int32_t>>&) const;
     void threshold(int64_t, int64_t);
     void prune(std::vector<int32_t>&);
 };
@@ -9,8 +9,16 @@
 
 #include "fasttext.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <chrono>
+#include <cstdio>
+#include <functional>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
@@ -18,24 +26,78 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <algorithm>
 
 
 namespace fasttext {
 
-FastText::FastText() : quant_(false) {}
+FastText::FastText()
+  : onlineStop_(false), onlineUpdates_(0), version_(FASTTEXT_VERSION),
+    quant_(false), collapsed_(false) {}
+
+FastText::~FastText() {
+  if (online_.joinable()) {
+    stopOnline();
+  }
+}
+
+void FastText::addInputRow(Vector& vec, int32_t i) const {
+  if (quant_) {
+    vec.addRow(*qinput_, i);
+  } else {
+    vec.addRow(*input_, i);
+  }
+}
 
 void FastText::getVector(Vector& vec, const std::string& word) const {
   const std::vector<int32_t>& ngrams = dict_->getSubwords(word);
   vec.zero();
   for (auto it = ngrams.begin(); it != ngrams.end(); ++it) {
-    vec.addRow(*input_, *it);
+    addInputRow(vec, *it);
   }
   if (ngrams.size() > 0) {
     vec.mul(1.0 / ngrams.size());
   }
 }
 
+// Sentence vectors are the average of the input rows of the line for
+// supervised models, and the average of the normalized word vectors
+// otherwise.
+void FastText::getSentenceVector(Vector& svec,
+                                 const std::string& sentence) const {
+  svec.zero();
+  if (args_->model == model_name::sup) {
+    std::vector<int32_t> line, labels;
+    std::istringstream in(sentence);
+    std::minstd_rand rng;
+    dict_->getLine(in, line, labels, rng);
+    for (auto it = line.cbegin(); it != line.cend(); ++it) {
+      addInputRow(svec, *it);
+    }
+    if (!line.empty()) {
+      svec.mul(1.0 / line.size());
+    }
+    return;
+  }
+  Vector vec(args_->dim);
+  std::istringstream iss(sentence);
+  std::string word;
+  int32_t count = 0;
+  while (iss >> word) {
+    getVector(vec, word);
+    real norm = vec.norm();
+    if (norm > 0) {
+      vec.mul(1.0 / norm);
+      svec.addVector(vec);
+      count++;
+    }
+  }
+  if (count > 0) {
+    svec.mul(1.0 / count);
+  }
+}
+
 void FastText::saveVectors() {
   std::ofstream ofs(args_->output + ".vec");
   if (!ofs.is_open()) {
@@ -43,11 +105,25 @@ void FastText::saveVectors() {
     exit(EXIT_FAILURE);
   }
   ofs << dict_->nwords() << " " << args_->dim << std::endl;
-  Vector vec(args_->dim);
-  for (int32_t i = 0; i < dict_->nwords(); i++) {
-    std::string word = dict_->getWord(i);
-    getVector(vec, word);
-    ofs << word << " " << vec << std::endl;
+  const int32_t batchSize = 16384;
+  std::vector<std::string> lines(batchSize);
+  auto pool = ThreadPool::global();
+  for (int32_t b = 0; b < dict_->nwords(); b += batchSize) {
+    const int32_t e = std::min(dict_->nwords(), b + batchSize);
+    pool->parallelFor(b, e, [&](int64_t begin, int64_t end) {
+      Vector vec(args_->dim);
+      std::ostringstream line;
+      for (int32_t i = begin; i < end; i++) {
+        std::string word = dict_->getWord(i);
+        getVector(vec, word);
+        line.str("");
+        line << word << " " << vec << '\n';
+        lines[i - b] = line.str();
+      }
+    }, 256);
+    for (int32_t i = b; i < e; i++) {
+      ofs << lines[i - b];
+    }
   }
   ofs.close();
 }
@@ -63,8 +139,14 @@ void FastText::saveOutput() {
   for (int32_t i = 0; i < dict_->nwords(); i++) {
     std::string word = dict_->getWord(i);
     vec.zero();
-    vec.addRow(*output_, i);
-    ofs << word << " " << vec << std::endl;
+    if (basis_) {
+      for (int64_t j = 0; j < basis_->m_; j++) {
+        vec.addRow(*basis_, j, output_->at(i, j));
+      }
+    } else {
+      vec.addRow(*output_, i);
+    }
+    ofs << word << " " << vec << '\n';
   }
   ofs.close();
 }
@@ -77,9 +159,10 @@ bool FastText::checkModel(std::istream& in) {
     return false;
   }
   in.read((char*)&(version), sizeof(int32_t));
-  if (version != FASTTEXT_VERSION) {
+  if (version < 11 || version > FASTTEXT_VERSION) {
     return false;
   }
+  version_ = version;
   return true;
 }
 
@@ -90,6 +173,34 @@ void FastText::signModel(std::ostream& out) {
   out.write((char*)&(version), sizeof(int32_t));
 }
 
+void FastText::saveMatrix(std::ostream& out, Matrix& matrix) {
+  bool compressed = args_->compress > 0;
+  out.write((char*) &compressed, sizeof(bool));
+  if (compressed) {
+    matrix.saveCompressed(out, args_->compress);
+  } else {
+    matrix.save(out);
+  }
+}
+
+void FastText::loadMatrix(std::istream& in, Matrix& matrix,
+                          const std::string& filename) {
+  bool compressed = false;
+  if (version_ > 11) {
+    in.read((char*) &compressed, sizeof(bool));
+  }
+  if (compressed) {
+    matrix.loadCompressed(in);
+  } else {
+    matrix.load(in, filename);
+  }
+}
+
+// The model is saved in sections. The dictionary and the quantized or
+// compressed matrices are serialized concurrently into memory, while
+// dense matrices are written straight from their storage. The file is
+// written under a temporary name and renamed once complete, so that an
+// interrupted save never leaves a truncated model behind.
 void FastText::saveModel() {
   std::string fn(args_->output);
   if (quant_) {
@@ -97,30 +208,87 @@ void FastText::saveModel() {
   } else {
     fn += ".bin";
   }
-  std::ofstream ofs(fn, std::ofstream::binary);
+  const bool compressed = args_->compress > 0;
+  std::vector<std::function<void(std::ostream&)>> sections;
+  std::vector<bool> buffered;
+  sections.push_back([this](std::ostream& out) {
+    signModel(out);
+    args_->save(out);
+    dict_->save(out);
+  });
+  buffered.push_back(true);
+  sections.push_back([this](std::ostream& out) {
+    out.write((char*)&(quant_), sizeof(bool));
+    if (quant_) {
+      qinput_->save(out);
+    } else {
+      saveMatrix(out, *input_);
+    }
+  });
+  buffered.push_back(quant_ || compressed);
+  sections.push_back([this](std::ostream& out) {
+    out.write((char*)&(args_->qout), sizeof(bool));
+    if (quant_ && args_->qout) {
+      qoutput_->save(out);
+    } else {
+      saveMatrix(out, *output_);
+    }
+  });
+  buffered.push_back((quant_ && args_->qout) || compressed);
+  sections.push_back([this](std::ostream& out) {
+    bool factorized = (basis_ != nullptr);
+    out.write((char*)&factorized, sizeof(bool));
+    if (factorized) {
+      saveMatrix(out, *basis_);
+    }
+    bool hashWords = dict_->hashWords();
+    out.write((char*)&hashWords, sizeof(bool));
+    out.write((char*)&collapsed_, sizeof(bool));
+  });
+  buffered.push_back(true);
+
+  std::vector<std::string> buffers(sections.size());
+  {
+    TaskGroup group(ThreadPool::global());
+    for (size_t i = 0; i < sections.size(); i++) {
+      if (!buffered[i]) continue;
+      group.run([&sections, &buffers, i]() {
+        std::ostringstream out;
+        sections[i](out);
+        buffers[i] = out.str();
+      });
+    }
+    group.wait();
+  }
+
+  std::string tmp = fn + ".tmp";
+  std::vector<char> buffer(SAVE_BUFFER_SIZE);
+  std::ofstream ofs;
+  ofs.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+  ofs.open(tmp, std::ofstream::binary);
   if (!ofs.is_open()) {
     std::cerr << "Model file cannot be opened for saving!" << std::endl;
     exit(EXIT_FAILURE);
   }
-  signModel(ofs);
-  args_->save(ofs);
-  dict_->save(ofs);
-
-  ofs.write((char*)&(quant_), sizeof(bool));
-  if (quant_) {
-    qinput_->save(ofs);
-  } else {
-    input_->save(ofs);
+  for (size_t i = 0; i < sections.size(); i++) {
+    if (buffered[i]) {
+      ofs.write(buffers[i].data(), buffers[i].size());
+    } else {
+      sections[i](ofs);
+    }
   }
-
-  ofs.write((char*)&(args_->qout), sizeof(bool));
-  if (quant_ && args_->qout) {
-    qoutput_->save(ofs);
-  } else {
-    output_->save(ofs);
+  ofs.close();
+  if (ofs.fail() || std::rename(tmp.c_str(), fn.c_str()) != 0) {
+    std::cerr << "Model file " << fn << " cannot be saved: "
+              << strerror(errno) << std::endl;
+    std::remove(tmp.c_str());
+    exit(EXIT_FAILURE);
   }
+}
 
-  ofs.close();
+void FastText::saveModel(const std::string& output) {
+  args_->output = output;
+  saveModel();
 }
 
 void FastText::loadModel(const std::string& filename) {
@@ -133,11 +301,15 @@ void FastText::loadModel(const std::string& filename) {
     std::cerr << "Model file has wrong file format!" << std::endl;
     exit(EXIT_FAILURE);
   }
-  loadModel(ifs);
+  loadModel(ifs, filename);
   ifs.close();
 }
 
 void FastText::loadModel(std::istream& in) {
+  loadModel(in, "");
+}
+
+void FastText::loadModel(std::istream& in, const std::string& filename) {
   args_ = std::make_shared<Args>();
   dict_ = std::make_shared<Dictionary>(args_);
   input_ = std::make_shared<Matrix>();
@@ -146,27 +318,64 @@ void FastText::loadModel(std::istream& in) {
   qoutput_ = std::make_shared<QMatrix>();
   args_->load(in);
 
-  dict_->load(in);
+  // subwords are computed while the matrices are being read
+  dict_->loadEntries(in);
+  TaskGroup tables(ThreadPool::global());
+  tables.run([this]() { dict_->initTables(); });
 
   bool quant_input;
   in.read((char*) &quant_input, sizeof(bool));
   if (quant_input) {
     quant_ = true;
-    qinput_->load(in);
+    qinput_->load(in, version_);
   } else {
-    input_->load(in);
+    loadMatrix(in, *input_, filename);
   }
 
   in.read((char*) &args_->qout, sizeof(bool));
   if (quant_ && args_->qout) {
-    qoutput_->load(in);
+    qoutput_->load(in, version_);
   } else {
-    output_->load(in);
+    loadMatrix(in, *output_, filename);
   }
 
+  bool factorized = false;
+  if (version_ > 11) {
+    in.read((char*) &factorized, sizeof(bool));
+  }
+  basis_.reset();
+  args_->outputRank = 0;
+  if (factorized) {
+    basis_ = std::make_shared<Matrix>();
+    loadMatrix(in, *basis_, filename);
+    args_->outputRank = basis_->m_;
+  }
+
+  bool hashWords = false;
+  if (version_ > 11) {
+    in.read((char*) &hashWords, sizeof(bool));
+  }
+  collapsed_ = false;
+  if (version_ > 12) {
+    in.read((char*) &collapsed_, sizeof(bool));
+  }
+  tables.wait();
+  dict_->setHashWords(hashWords);
+
+  initModel();
+}
+
+// Builds the model used for predictions on the current matrices.
+void FastText::initModel() {
   model_ = std::make_shared<Model>(input_, output_, args_, 0);
+  if (basis_) {
+    model_->setBasis(basis_);
+  }
   model_->quant_ = quant_;
-  model_->setQuantizePointer(qinput_, qoutput_, args_->qout);
+  if (quant_) {
+    model_->setQuantizePointer(qinput_, qoutput_, args_->qout);
+  }
+  model_->setCollapsed(collapsed_);
 
   if (args_->model == model_name::sup) {
     model_->setTargetCounts(dict_->getCounts(entry_type::label));
@@ -210,10 +419,22 @@ void FastText::quantize(std::shared_ptr<Args> qargs) {
       std::cerr<<"No model provided!"<<std::endl; exit(1);
   }
   loadModel(qargs->output + ".bin");
+  quantizeModel(qargs);
+  saveModel();
+}
 
+// Quantizes the model in memory, after pruning and retraining the input
+// matrix if qargs has a cutoff.
+void FastText::quantizeModel(std::shared_ptr<Args> qargs) {
+  if (collapsed_ && (qargs->qout || qargs->retrain)) {
+    std::cerr << "Collapsed models have no output matrix to quantize "
+              << "and cannot be retrained." << std::endl;
+    exit(EXIT_FAILURE);
+  }
   args_->input = qargs->input;
   args_->qout = qargs->qout;
   args_->output = qargs->output;
+  args_->compress = qargs->compress;
 
 
   if (qargs->cutoff > 0 && qargs->cutoff < input_->m_) {
@@ -232,26 +453,25 @@ void FastText::quantize(std::shared_ptr<Args> qargs) {
       args_->lr = qargs->lr;
       args_->thread = qargs->thread;
       args_->verbose = qargs->verbose;
-      start = clock();
-      tokenCount = 0;
-      std::vector<std::thread> threads;
-      for (int32_t i = 0; i < args_->thread; i++) {
-        threads.push_back(std::thread([=]() { trainThread(i); }));
-      }
-      for (auto it = threads.begin(); it != threads.end(); ++it) {
-        it->join();
-      }
+      startThreads();
     }
   }
 
-  qinput_ = std::make_shared<QMatrix>(*input_, qargs->dsub, qargs->qnorm);
+  qinput_ = std::make_shared<QMatrix>(
+      *input_, qargs->dsub, qargs->qnorm, qargs->qbatch, qargs->rdsub);
+  if (qargs->verbose > 0) {
+    std::cerr << "Quantized input: " << qinput_->size() << " bytes"
+              << ", relative error: " << qinput_->relativeError(*input_)
+              << std::endl;
+  }
 
   if (args_->qout) {
-    qoutput_ = std::make_shared<QMatrix>(*output_, 2, qargs->qnorm);
+    qoutput_ = std::make_shared<QMatrix>(
+        *output_, 2, qargs->qnorm, qargs->qbatch, 0);
   }
 
   quant_ = true;
-  saveModel();
+  initModel();
 }
 
 void FastText::supervised(Model& model, real lr,
@@ -283,35 +503,349 @@ void FastText::cbow(Model& model, real lr,
 void FastText::skipgram(Model& model, real lr,
                         const std::vector<int32_t>& line) {
   std::uniform_int_distribution<> uniform(1, args_->ws);
+  std::vector<int32_t> contexts;
   for (int32_t w = 0; w < line.size(); w++) {
     int32_t boundary = uniform(model.rng);
     const std::vector<int32_t>& ngrams = dict_->getSubwords(line[w]);
+    contexts.clear();
     for (int32_t c = -boundary; c <= boundary; c++) {
       if (c != 0 && w + c >= 0 && w + c < line.size()) {
-        model.update(ngrams, line[w + c], lr);
+        if (args_->sharedNeg > 0) {
+          contexts.push_back(line[w + c]);
+        } else {
+          model.update(ngrams, line[w + c], lr);
+        }
       }
     }
+    if (!contexts.empty()) {
+      model.updateBlock(ngrams, contexts, lr);
+    }
   }
 }
 
-void FastText::test(std::istream& in, int32_t k) {
-  int32_t nexamples = 0, nlabels = 0;
-  double precision = 0.0;
+// Records the rows touched by one prediction out of period from now on.
+void FastText::setProfile(int32_t period) {
+  int64_t inputRows = quant_ ? qinput_->getM() : input_->m_;
+  int64_t outputRows = quant_ && args_->qout ? qoutput_->getM() : output_->m_;
+  profile_ = std::make_shared<RowProfile>(inputRows, outputRows, period);
+  model_->setProfile(profile_);
+}
+
+std::string FastText::rowName(bool output, int32_t i,
+                              const std::vector<std::string>& ngrams) const {
+  if (output) {
+    if (args_->loss == loss_name::hs) {
+      return "<node " + std::to_string(i) + ">";
+    }
+    return args_->model == model_name::sup ? dict_->getLabel(i)
+                                           : dict_->getWord(i);
+  }
+  if (i < dict_->nwords()) {
+    return dict_->getWord(i);
+  }
+  if (!ngrams[i - dict_->nwords()].empty()) {
+    return ngrams[i - dict_->nwords()];
+  }
+  return "<bucket " + std::to_string(i - dict_->nwords()) + ">";
+}
+
+// Prints how the sampled accesses spread over the rows: a histogram of the
+// rows by access count (in powers of two), the share of the accesses that go
+// to the hottest rows, and the top rows of each matrix.
+void FastText::dumpProfile(std::ostream& out, int32_t top) const {
+  if (!profile_) {
+    return;
+  }
+  const bool isOutput[2] = {false, true};
+  const std::vector<uint32_t> counts[2] = {profile_->inputCounts(),
+                                           profile_->outputCounts()};
+  out << "samples\t" << profile_->samples() << " (1 out of "
+      << profile_->period() << ")" << std::endl;
+
+  std::vector<std::string> ngrams(counts[0].size() - dict_->nwords());
+  std::vector<int32_t> ids;
+  std::vector<std::string> substrings;
+  for (int32_t i = 0; i < dict_->nwords(); i++) {
+    dict_->getSubwords(dict_->getWord(i), ids, substrings);
+    for (int32_t j = 0; j < ids.size(); j++) {
+      int64_t b = int64_t(ids[j]) - dict_->nwords();
+      if (b >= 0 && b < ngrams.size() && ngrams[b].empty()) {
+        ngrams[b] = substrings[j];
+      }
+    }
+  }
+
+  for (int32_t m = 0; m < 2; m++) {
+    const std::vector<uint32_t>& c = counts[m];
+    std::vector<int32_t> rows;
+    std::vector<int64_t> histogram;
+    uint64_t total = 0;
+    for (int32_t i = 0; i < c.size(); i++) {
+      if (c[i] == 0) continue;
+      rows.push_back(i);
+      total += c[i];
+      int32_t bucket = 0;
+      while ((uint64_t(1) << (bucket + 1)) <= c[i]) bucket++;
+      if (histogram.size() <= bucket) {
+        histogram.resize(bucket + 1, 0);
+      }
+      histogram[bucket]++;
+    }
+    std::sort(rows.begin(), rows.end(), [&c](int32_t a, int32_t b) {
+      return c[a] > c[b] || (c[a] == c[b] && a < b);
+    });
+
+    out << std::endl << (m == 0 ? "input" : "output") << " rows" << std::endl;
+    out << "accesses\t" << total << std::endl;
+    out << "touched\t" << rows.size() << " / " << c.size() << std::endl;
+    if (total == 0) continue;
+    const double shares[2] = {0.01, 0.1};
+    for (int32_t s = 0; s < 2; s++) {
+      int64_t n = std::max(int64_t(1), int64_t(shares[s] * rows.size()));
+      uint64_t hot = 0;
+      for (int64_t i = 0; i < n; i++) {
+        hot += c[rows[i]];
+      }
+      out << "top " << shares[s] * 100 << "%\t" << n << " rows, "
+          << std::setprecision(3) << 100.0 * hot / total << "% of accesses"
+          << std::endl;
+    }
+    out << "histogram" << std::endl;
+    for (int32_t b = 0; b < histogram.size(); b++) {
+      if (histogram[b] == 0) continue;
+      out << "  [" << (uint64_t(1) << b) << ", " << (uint64_t(1) << (b + 1))
+          << ")\t" << histogram[b] << std::endl;
+    }
+    out << "top rows" << std::endl;
+    for (int32_t i = 0; i < std::min(int64_t(top), int64_t(rows.size())); i++) {
+      out << "  " << rows[i] << "\t" << c[rows[i]] << "\t"
+          << rowName(isOutput[m], rows[i], ngrams) << std::endl;
+    }
+  }
+}
+
+// Starts updating the model from the examples passed to learn, on a
+// background thread, while predictions keep being served. The rows written
+// by the updates are guarded by sequence locks so that predictions never see
+// a partially updated row. If snapshotEvery is positive, the model is saved
+// to output every snapshotEvery examples and when stopOnline is called, so
+// that a saved model is at most snapshotEvery examples behind.
+void FastText::startOnline(real lr, int64_t snapshotEvery,
+                           const std::string& output) {
+  if (args_->model != model_name::sup) {
+    std::cerr << "Online learning is only supported for supervised models."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (quant_ || basis_ || collapsed_) {
+    std::cerr << "Online learning is not supported for quantized, "
+              << "factorized or collapsed models." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (online_.joinable()) {
+    std::cerr << "Online learning is already running." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  args_->output = output;
+  auto inputLocks = std::make_shared<RowLocks>(RowLocks::DEFAULT_STRIPES);
+  auto outputLocks = std::make_shared<RowLocks>(RowLocks::DEFAULT_STRIPES);
+  model_->setLocks(inputLocks, outputLocks);
+  auto model = std::make_shared<Model>(input_, output_, args_, 0);
+  model->setTargetCounts(dict_->getCounts(entry_type::label));
+  model->setLocks(inputLocks, outputLocks);
+  model->setProfile(profile_);
+
+  onlineStop_ = false;
+  onlineUpdates_ = 0;
+  online_ = std::thread([=]() { onlineThread(model, lr, snapshotEvery); });
+}
+
+void FastText::onlineThread(std::shared_ptr<Model> model, real lr,
+                            int64_t snapshotEvery) {
   std::vector<int32_t> line, labels;
+  std::string example;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(onlineMutex_);
+      onlineCv_.wait(lock, [this]() {
+        return onlineStop_ || !onlineQueue_.empty();
+      });
+      if (onlineQueue_.empty()) {
+        break;
+      }
+      example = std::move(onlineQueue_.front());
+      onlineQueue_.pop_front();
+    }
+    onlineCv_.notify_all();
+    std::istringstream in(example);
+    dict_->getLine(in, line, labels, model->rng);
+    supervised(*model, lr, line, labels);
+    int64_t updates = ++onlineUpdates_;
+    if (snapshotEvery > 0 && updates % snapshotEvery == 0) {
+      saveModel();
+    }
+  }
+  if (snapshotEvery > 0) {
+    saveModel();
+  }
+}
 
-  while (in.peek() != EOF) {
-    dict_->getLine(in, line, labels, model_->rng);
-    if (labels.size() > 0 && line.size() > 0) {
-      std::vector<std::pair<real, int32_t>> modelPredictions;
-      model_->predict(line, k, modelPredictions);
-      for (auto it = modelPredictions.cbegin(); it != modelPredictions.cend(); it++) {
-        if (std::find(labels.begin(), labels.end(), it->second) != labels.end()) {
-          precision += 1.0;
+// Queues a labeled example for the online updates, blocking while the
+// queue is full.
+void FastText::learn(const std::string& example) {
+  {
+    std::unique_lock<std::mutex> lock(onlineMutex_);
+    onlineCv_.wait(lock, [this]() {
+      return onlineQueue_.size() < ONLINE_QUEUE_SIZE;
+    });
+    onlineQueue_.push_back(example);
+  }
+  onlineCv_.notify_all();
+}
+
+// Applies the queued examples and waits for the background thread.
+void FastText::stopOnline() {
+  {
+    std::lock_guard<std::mutex> lock(onlineMutex_);
+    onlineStop_ = true;
+  }
+  onlineCv_.notify_all();
+  if (online_.joinable()) {
+    online_.join();
+  }
+}
+
+int64_t FastText::onlineUpdates() const {
+  return onlineUpdates_;
+}
+
+// Folds the output layer into the input matrix. The model is linear up to
+// the softmax, so the scores of an input are the average of the products of
+// its rows with the output matrix: these products are precomputed, and
+// predicting only sums rows of nlabels scores. This pays off when there are
+// fewer labels than dimensions.
+void FastText::collapse() {
+  if (args_->model != model_name::sup) {
+    std::cerr << "Only supervised models can be collapsed." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (quant_ || collapsed_) {
+    std::cerr << "The model is already quantized or collapsed, "
+              << "it must be collapsed before quantizing." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::shared_ptr<Matrix> output = output_;
+  if (basis_) {
+    output = std::make_shared<Matrix>(output_->m_, args_->dim);
+    output->zero();
+    for (int64_t i = 0; i < output_->m_; i++) {
+      for (int64_t r = 0; r < basis_->m_; r++) {
+        for (int64_t j = 0; j < args_->dim; j++) {
+          output->at(i, j) += output_->at(i, r) * basis_->at(r, j);
+        }
+      }
+    }
+  }
+  auto collapsed = std::make_shared<Matrix>(input_->m_, output->m_);
+  ThreadPool::global()->parallelFor(0, input_->m_, [&](int64_t begin,
+                                                       int64_t end) {
+    Vector row(args_->dim);
+    for (int64_t i = begin; i < end; i++) {
+      row.zero();
+      row.addRow(*input_, i);
+      for (int64_t j = 0; j < output->m_; j++) {
+        collapsed->at(i, j) = output->dotRow(row, j);
+      }
+    }
+  }, 1024);
+  if (args_->verbose > 0) {
+    std::cerr << "Collapsed " << input_->m_ << " rows from " << args_->dim
+              << " to " << output->m_ << " columns" << std::endl;
+  }
+  input_ = collapsed;
+  output_ = std::make_shared<Matrix>(output->m_, 0);
+  basis_.reset();
+  args_->outputRank = 0;
+  args_->dim = input_->n_;
+  collapsed_ = true;
+  initModel();
+}
+
+// Predicts the top k labels of the lines of in by batches of batchSize
+// lines, and hands each batch with its predictions to write in order. The
+// batches go through a pipeline of the given depth on the global pool, so
+// that the next batch is read while the current one is predicted.
+void FastText::predictBatches(
+    std::istream& in, int32_t k, int32_t batchSize, int32_t depth,
+    std::function<void(const std::vector<std::vector<int32_t>>&,
+                       const std::vector<std::vector<int32_t>>&,
+                       const std::vector<std::vector<
+                           std::pair<real, int32_t>>>&)> write) {
+  std::vector<std::vector<std::vector<int32_t>>> lines(depth), labels(depth);
+  std::vector<std::vector<std::vector<std::pair<real, int32_t>>>>
+      predictions(depth);
+  auto pool = ThreadPool::global();
+  auto read = [&](int32_t s) {
+    if (in.peek() == EOF) {
+      return false;
+    }
+    dict_->getLines(in, batchSize, lines[s], labels[s]);
+    return true;
+  };
+  auto process = [&](int32_t s) {
+    predictions[s].resize(lines[s].size());
+    pool->parallelFor(0, lines[s].size(), [&](int64_t begin, int64_t end) {
+      Vector hidden(args_->dim);
+      Vector output(dict_->nlabels());
+      model_->predict(lines[s], begin, end, k, predictions[s], hidden,
+                      output);
+    }, 16);
+  };
+  pool->pipeline(read, process, [&](int32_t s) {
+    write(lines[s], labels[s], predictions[s]);
+  }, depth);
+}
+
+// Predicts the top kmax labels of each example once, and counts in hits[r]
+// the correct labels predicted at rank r, so that the precision and recall
+// at every k <= kmax follow from the prefix sums of hits.
+void FastText::test(std::istream& in, int32_t kmax, std::vector<int64_t>& hits,
+                    int64_t& nexamples, int64_t& nlabels) {
+  std::vector<bool> isLabel(dict_->nlabels(), false);
+  hits.assign(kmax, 0);
+  nexamples = 0;
+  nlabels = 0;
+  predictBatches(in, kmax, 1024, 2, [&](
+      const std::vector<std::vector<int32_t>>& lines,
+      const std::vector<std::vector<int32_t>>& labels,
+      const std::vector<std::vector<std::pair<real, int32_t>>>& predictions) {
+    for (size_t l = 0; l < lines.size(); l++) {
+      if (labels[l].size() > 0 && lines[l].size() > 0) {
+        for (auto it = labels[l].cbegin(); it != labels[l].cend(); ++it) {
+          isLabel[*it] = true;
         }
+        for (int32_t r = 0; r < predictions[l].size(); r++) {
+          if (isLabel[predictions[l][r].second]) {
+            hits[r]++;
+          }
+        }
+        for (auto it = labels[l].cbegin(); it != labels[l].cend(); ++it) {
+          isLabel[*it] = false;
+        }
+        nexamples++;
+        nlabels += labels[l].size();
       }
-      nexamples++;
-      nlabels += labels.size();
     }
+  });
+}
+
+void FastText::test(std::istream& in, int32_t k) {
+  std::vector<int64_t> hits;
+  int64_t nexamples, nlabels;
+  test(in, k, hits, nexamples, nlabels);
+  double precision = 0.0;
+  for (int32_t r = 0; r < k; r++) {
+    precision += hits[r];
   }
   std::cout << "N" << "\t" << nexamples << std::endl;
   std::cout << std::setprecision(3);
@@ -320,6 +854,22 @@ void FastText::test(std::istream& in, int32_t k) {
   std::cerr << "Number of examples: " << nexamples << std::endl;
 }
 
+// Evaluates every k up to kmax in a single pass over the test data.
+void FastText::testSweep(std::istream& in, int32_t kmax) {
+  std::vector<int64_t> hits;
+  int64_t nexamples, nlabels;
+  test(in, kmax, hits, nexamples, nlabels);
+  std::cout << "N" << "\t" << nexamples << std::endl;
+  std::cout << std::setprecision(3);
+  double precision = 0.0;
+  for (int32_t k = 1; k <= kmax; k++) {
+    precision += hits[k - 1];
+    std::cout << "P@" << k << "\t" << precision / (k * nexamples) << "\t"
+              << "R@" << k << "\t" << precision / nlabels << std::endl;
+  }
+  std::cerr << "Number of examples: " << nexamples << std::endl;
+}
+
 void FastText::predict(std::istream& in, int32_t k,
                        std::vector<std::pair<real,std::string>>& predictions) const {
   std::vector<int32_t> words, labels;
@@ -336,24 +886,192 @@ void FastText::predict(std::istream& in, int32_t k,
 }
 
 void FastText::predict(std::istream& in, int32_t k, bool print_prob) {
-  std::vector<std::pair<real,std::string>> predictions;
-  while (in.peek() != EOF) {
-    predict(in, k, predictions);
-    if (predictions.empty()) {
+  // Lines of the standard input are answered one at a time, before reading
+  // further, so that a client can wait for each answer.
+  const bool interactive = (&in == &std::cin);
+  const int32_t batchSize = interactive ? 1 : 16 * ThreadPool::global()->size();
+  predictBatches(in, k, batchSize, interactive ? 1 : 2, [&](
+      const std::vector<std::vector<int32_t>>&,
+      const std::vector<std::vector<int32_t>>&,
+      const std::vector<std::vector<std::pair<real, int32_t>>>& predictions) {
+    for (size_t l = 0; l < predictions.size(); l++) {
+      for (auto it = predictions[l].cbegin(); it != predictions[l].cend(); it++) {
+        if (it != predictions[l].cbegin()) {
+          std::cout << " ";
+        }
+        std::cout << dict_->getLabel(it->second);
+        if (print_prob) {
+          std::cout << " " << exp(it->first);
+        }
+      }
       std::cout << std::endl;
-      continue;
+    }
+  });
+}
+
+// Predicts every window of `window` consecutive lines, moving by `stride`
+// lines, as if the lines of each window (with their end of sentence
+// tokens) formed a single input. Instead of recomputing the hidden layer
+// of every window, a running sum of its input rows is kept: lines entering
+// the window add their words and the word n-grams ending in them, lines
+// leaving it remove their words and the word n-grams starting in them.
+void FastText::predictWindows(std::istream& in, int32_t window,
+                              int32_t stride, int32_t k, bool print_prob) {
+  const int32_t n = (args_->model == model_name::sup) ? args_->wordNgrams : 1;
+  std::deque<std::pair<std::vector<int32_t>, int32_t>> lines;
+  std::vector<int32_t> words, hashes, labels, lineHashes;
+  std::vector<double> sum(args_->dim, 0.0);
+  int64_t count = 0;
+  Vector hidden(args_->dim), row(args_->dim);
+  Vector output(dict_->nlabels());
+  std::vector<std::pair<real, int32_t>> predictions;
+
+  auto addRow = [&](int32_t id, real a) {
+    row.zero();
+    if (quant_) {
+      row.addRow(*qinput_, id);
+    } else {
+      row.addRow(*input_, id);
+    }
+    for (int32_t j = 0; j < args_->dim; j++) {
+      sum[j] += a * row[j];
+    }
+    count += (a > 0) ? 1 : -1;
+  };
+  auto push = [&](const std::vector<int32_t>& lineWords) {
+    const int32_t begin = hashes.size();
+    hashes.insert(hashes.end(), lineHashes.begin(), lineHashes.end());
+    for (int32_t i = begin; i < hashes.size(); i++) {
+      for (int32_t l = 2; l <= n && i - l + 1 >= 0; l++) {
+        int32_t id = dict_->getWordNgram(hashes, i - l + 1, l);
+        if (id >= 0) addRow(id, 1.0);
+      }
+    }
+    for (auto it = lineWords.cbegin(); it != lineWords.cend(); ++it) {
+      addRow(*it, 1.0);
+    }
+    lines.push_back(std::make_pair(lineWords, lineHashes.size()));
+  };
+  auto pop = [&]() {
+    const std::vector<int32_t>& lineWords = lines.front().first;
+    const int32_t nhashes = lines.front().second;
+    for (int32_t i = 0; i < nhashes; i++) {
+      for (int32_t l = 2; l <= n && i + l <= hashes.size(); l++) {
+        int32_t id = dict_->getWordNgram(hashes, i, l);
+        if (id >= 0) addRow(id, -1.0);
+      }
+    }
+    for (auto it = lineWords.cbegin(); it != lineWords.cend(); ++it) {
+      addRow(*it, -1.0);
+    }
+    hashes.erase(hashes.begin(), hashes.begin() + nhashes);
+    lines.pop_front();
+  };
+  auto print = [&]() {
+    predictions.clear();
+    if (count > 0) {
+      for (int32_t j = 0; j < args_->dim; j++) {
+        hidden[j] = sum[j] / count;
+      }
+      model_->predictFromHidden(k, predictions, hidden, output);
     }
     for (auto it = predictions.cbegin(); it != predictions.cend(); it++) {
       if (it != predictions.cbegin()) {
         std::cout << " ";
       }
-      std::cout << it->second;
+      std::cout << dict_->getLabel(it->second);
       if (print_prob) {
         std::cout << " " << exp(it->first);
       }
     }
     std::cout << std::endl;
+  };
+
+  int32_t pending = 0, needed = window;
+  while (in.peek() != EOF) {
+    dict_->getLine(in, words, lineHashes, labels, model_->rng);
+    push(words);
+    while (lines.size() > window) {
+      pop();
+    }
+    if (++pending == needed) {
+      print();
+      pending = 0;
+      needed = stride;
+    }
+  }
+  if (pending > 0) {
+    print();
+  }
+}
+
+void FastText::setScoringThreads(int32_t nthreads, int32_t threshold) {
+  model_->setScoringThreads(nthreads, threshold);
+}
+
+// Brings a freshly loaded model to steady-state latency. The matrices were
+// read into memory by loadModel, so their pages are already resident: they
+// are only locked in memory if requested, so that they cannot be swapped
+// out. The queries of the given file, if any, are then run through the
+// batched predict path used to serve files, which warms the caches and
+// the branch predictors up.
+void FastText::warmup(const std::string& queries, bool lock) {
+  auto start = std::chrono::steady_clock::now();
+  int64_t size = 0;
+  if (lock) {
+    bool locked = true;
+    if (quant_) {
+      size += qinput_->size();
+      locked &= qinput_->lock();
+    } else {
+      size += input_->m_ * input_->n_ * sizeof(real);
+      locked &= utils::lock(input_->data_, size);
+    }
+    if (quant_ && args_->qout) {
+      size += qoutput_->size();
+      locked &= qoutput_->lock();
+    } else {
+      int64_t osize = output_->m_ * output_->n_ * sizeof(real);
+      locked &= utils::lock(output_->data_, osize);
+      size += osize;
+    }
+    if (basis_) {
+      int64_t bsize = basis_->m_ * basis_->n_ * sizeof(real);
+      locked &= utils::lock(basis_->data_, bsize);
+      size += bsize;
+    }
+    if (!locked) {
+      std::cerr << "Warning: model pages could not be locked in memory."
+                << std::endl;
+    }
   }
+  auto locked = std::chrono::steady_clock::now();
+  int64_t nqueries = 0;
+  if (!queries.empty()) {
+    std::ifstream ifs(queries);
+    if (!ifs.is_open()) {
+      std::cerr << "Warm-up queries file cannot be opened!" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    predictBatches(ifs, 1, 16 * ThreadPool::global()->size(), 2, [&](
+        const std::vector<std::vector<int32_t>>& lines,
+        const std::vector<std::vector<int32_t>>&,
+        const std::vector<std::vector<std::pair<real, int32_t>>>&) {
+      nqueries += lines.size();
+    });
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::cerr << "Warm-up: ";
+  if (lock) {
+    std::cerr << "locked " << size / (1 << 20) << " MB in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     locked - start).count()
+              << " ms, ";
+  }
+  std::cerr << "replayed " << nqueries << " queries in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   end - locked).count()
+            << " ms" << std::endl;
 }
 
 void FastText::wordVectors() {
@@ -361,32 +1079,16 @@ void FastText::wordVectors() {
   Vector vec(args_->dim);
   while (std::cin >> word) {
     getVector(vec, word);
-    std::cout << word << " " << vec << std::endl;
+    std::cout << word << " " << vec << '\n';
   }
 }
 
 void FastText::sentenceVectors() {
-  Vector vec(args_->dim);
   std::string sentence;
   Vector svec(args_->dim);
-  std::string word;
   while (std::getline(std::cin, sentence)) {
-    std::istringstream iss(sentence);
-    svec.zero();
-    int32_t count = 0;
-    while(iss >> word) {
-      getVector(vec, word);
-      real norm = vec.norm();
-      if (norm > 0) {
-        vec.mul(1.0 / norm);
-        svec.addVector(vec);
-        count++;
-      }
-    }
-    if (count > 0) {
-      svec.mul(1.0 / count);
-    }
-    std::cout << sentence << " " << svec << std::endl;
+    getSentenceVector(svec, sentence);
+    std::cout << sentence << " " << svec << '\n';
   }
 }
 
@@ -398,7 +1100,7 @@ void FastText::ngramVectors(std::string word) {
   for (int32_t i = 0; i < ngrams.size(); i++) {
     vec.zero();
     if (ngrams[i] >= 0) {
-      vec.addRow(*input_, ngrams[i]);
+      addInputRow(vec, ngrams[i]);
     }
     std::cout << substrings[i] << " " << vec << std::endl;
   }
@@ -411,12 +1113,12 @@ void FastText::textVectors() {
     dict_->getLine(std::cin, line, labels, model_->rng);
     vec.zero();
     for (auto it = line.cbegin(); it != line.cend(); ++it) {
-      vec.addRow(*input_, *it);
+      addInputRow(vec, *it);
     }
     if (!line.empty()) {
       vec.mul(1.0 / line.size());
     }
-    std::cout << vec << std::endl;
+    std::cout << vec << '\n';
   }
 }
 
@@ -447,6 +1149,20 @@ void FastText::precomputeWordVectors(Matrix& wordVectors) {
   std::cerr << " done." << std::endl;
 }
 
+// Prints the k most similar entries of the heap that are not banned.
+void FastText::printNN(std::priority_queue<std::pair<real, std::string>>& heap,
+                       int32_t k, const std::set<std::string>& banSet) const {
+  int32_t i = 0;
+  while (i < k && heap.size() > 0) {
+    auto it = banSet.find(heap.top().second);
+    if (it == banSet.end()) {
+      std::cout << heap.top().second << " " << heap.top().first << std::endl;
+      i++;
+    }
+    heap.pop();
+  }
+}
+
 void FastText::findNN(const Matrix& wordVectors, const Vector& queryVec,
                       int32_t k, const std::set<std::string>& banSet) {
   real queryNorm = queryVec.norm();
@@ -460,18 +1176,41 @@ void FastText::findNN(const Matrix& wordVectors, const Vector& queryVec,
     real dp = wordVectors.dotRow(queryVec, i);
     heap.push(std::make_pair(dp / queryNorm, word));
   }
-  int32_t i = 0;
-  while (i < k && heap.size() > 0) {
-    auto it = banSet.find(heap.top().second);
-    if (it == banSet.end()) {
-      std::cout << heap.top().second << " " << heap.top().first << std::endl;
-      i++;
+  printNN(heap, k, banSet);
+}
+
+// Same as above for quantized models, without reconstructing the word
+// vectors: the dot products of the query with the rows are read from its
+// asymmetric distance tables, and only the norms of the words are stored.
+void FastText::findNN(const std::vector<real>& wordNorms,
+                      const Vector& queryVec, int32_t k,
+                      const std::set<std::string>& banSet) {
+  real queryNorm = queryVec.norm();
+  if (std::abs(queryNorm) < 1e-8) {
+    queryNorm = 1;
+  }
+  std::vector<real> tables;
+  qinput_->computeTables(queryVec, tables);
+  std::priority_queue<std::pair<real, std::string>> heap;
+  for (int32_t i = 0; i < dict_->nwords(); i++) {
+    real dp = 0.0;
+    if (wordNorms[i] > 0) {
+      const std::vector<int32_t>& ngrams = dict_->getSubwords(i);
+      for (auto it = ngrams.cbegin(); it != ngrams.cend(); ++it) {
+        dp += qinput_->dotRow(tables, *it);
+      }
+      dp /= ngrams.size() * wordNorms[i];
     }
-    heap.pop();
+    heap.push(std::make_pair(dp / queryNorm, dict_->getWord(i)));
   }
+  printNN(heap, k, banSet);
 }
 
 void FastText::nn(int32_t k) {
+  if (quant_) {
+    nnQuantized(k);
+    return;
+  }
   std::string queryWord;
   Vector queryVec(args_->dim);
   Matrix wordVectors(dict_->nwords(), args_->dim);
@@ -487,6 +1226,215 @@ void FastText::nn(int32_t k) {
   }
 }
 
+// Binary codes of the word vectors, or of the vectors of the given
+// sentences if there are any.
+std::shared_ptr<BinaryMatrix> FastText::binaryCodes(
+    int32_t bits, const std::vector<std::string>& sentences) const {
+  const bool words = sentences.empty();
+  const int64_t m = words ? dict_->nwords() : sentences.size();
+  auto codes = std::make_shared<BinaryMatrix>(m, args_->dim, bits, 0);
+  ThreadPool::global()->parallelFor(0, m, [&](int64_t begin, int64_t end) {
+    Vector vec(args_->dim);
+    for (int64_t i = begin; i < end; i++) {
+      if (words) {
+        getVector(vec, dict_->getWord(i));
+      } else {
+        getSentenceVector(vec, sentences[i]);
+      }
+      codes->setRow(i, vec);
+    }
+  }, 1024);
+  return codes;
+}
+
+void FastText::saveCodes(BinaryMatrix& codes,
+                         const std::string& filename) const {
+  std::ofstream ofs(filename, std::ofstream::binary);
+  if (!ofs.is_open()) {
+    std::cerr << "Codes file cannot be opened for saving!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  codes.save(ofs);
+  ofs.close();
+}
+
+// Loads the codes of the words of the model, or of the given sentences if
+// there are any.
+std::shared_ptr<BinaryMatrix> FastText::loadCodes(
+    const std::string& filename,
+    const std::vector<std::string>& sentences) const {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  if (!ifs.is_open()) {
+    std::cerr << "Codes file cannot be opened for loading!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  auto codes = std::make_shared<BinaryMatrix>();
+  codes->load(ifs);
+  const int64_t m = sentences.empty() ? dict_->nwords() : sentences.size();
+  if (!ifs || codes->getM() != m || codes->getN() != args_->dim) {
+    std::cerr << "The codes do not match the model and sentences."
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  ifs.close();
+  return codes;
+}
+
+// Candidates are first selected with the binary codes, and then reranked
+// with the exact cosine similarity of their vectors, which are recomputed
+// rather than stored. The codes are those of the words of the model, or of
+// the given sentences if there are any, in which case the queries are
+// sentences as well.
+void FastText::nn(int32_t k, const BinaryMatrix& codes,
+                  const std::vector<std::string>& sentences) {
+  const bool words = sentences.empty();
+  std::cerr << "Binary codes: " << codes.size() << " bytes" << std::endl;
+  std::string query;
+  Vector queryVec(args_->dim);
+  Vector vec(args_->dim);
+  std::vector<int64_t> candidates;
+  std::set<std::string> banSet;
+  std::cout << (words ? "Query word? " : "Query sentence? ");
+  while (words ? bool(std::cin >> query) : bool(std::getline(std::cin, query))) {
+    banSet.clear();
+    if (words) {
+      banSet.insert(query);
+      getVector(queryVec, query);
+    } else {
+      getSentenceVector(queryVec, query);
+    }
+    real queryNorm = queryVec.norm();
+    if (std::abs(queryNorm) < 1e-8) {
+      queryNorm = 1;
+    }
+    codes.search(queryVec, NN_RERANK_FACTOR * (k + 1), candidates);
+    std::priority_queue<std::pair<real, std::string>> heap;
+    for (auto it = candidates.cbegin(); it != candidates.cend(); ++it) {
+      const std::string& entry = words ? dict_->getWord(*it) : sentences[*it];
+      if (words) {
+        getVector(vec, entry);
+      } else {
+        getSentenceVector(vec, entry);
+      }
+      real dp = 0.0;
+      real norm = vec.norm();
+      if (norm > 0) {
+        for (int64_t j = 0; j < args_->dim; j++) {
+          dp += vec[j] * queryVec[j];
+        }
+        dp /= norm;
+      }
+      heap.push(std::make_pair(dp / queryNorm, entry));
+    }
+    printNN(heap, k, banSet);
+    std::cout << (words ? "Query word? " : "Query sentence? ");
+  }
+}
+
+void FastText::nnQuantized(int32_t k) {
+  std::string queryWord;
+  Vector queryVec(args_->dim);
+  std::vector<real> wordNorms(dict_->nwords());
+  std::cerr << "Pre-computing word norms...";
+  for (int32_t i = 0; i < dict_->nwords(); i++) {
+    getVector(queryVec, dict_->getWord(i));
+    wordNorms[i] = queryVec.norm();
+  }
+  std::cerr << " done." << std::endl;
+  std::set<std::string> banSet;
+  std::cout << "Query word? ";
+  while (std::cin >> queryWord) {
+    banSet.clear();
+    banSet.insert(queryWord);
+    getVector(queryVec, queryWord);
+    findNN(wordNorms, queryVec, k, banSet);
+    std::cout << "Query word? ";
+  }
+}
+
+void FastText::exportShm(const std::string& name) {
+  std::string shmName(name);
+  if (shmName.empty() || shmName[0] != '/') {
+    shmName = "/" + shmName;
+  }
+  const int64_t nwords = dict_->nwords();
+  const int64_t dim = args_->dim;
+
+  ShmHeader header;
+  header.magic = FASTTEXT_SHM_MAGIC_INT32;
+  header.version = FASTTEXT_SHM_VERSION;
+  header.nwords = nwords;
+  header.dim = dim;
+  header.offsetsOffset = sizeof(ShmHeader);
+  header.wordsOffset = header.offsetsOffset + nwords * sizeof(int64_t);
+  header.wordsSize = 0;
+  for (int32_t i = 0; i < nwords; i++) {
+    header.wordsSize += dict_->getWord(i).size() + 1;
+  }
+  header.vectorsOffset = (header.wordsOffset + header.wordsSize + 63) & ~63;
+  header.size = header.vectorsOffset + nwords * dim * sizeof(real);
+
+  // A previous segment is unlinked rather than truncated: readers that
+  // mapped it keep their pages, and a fresh one is created under the name.
+  if (shm_unlink(shmName.c_str()) != 0 && errno != ENOENT) {
+    std::cerr << "Shared memory segment " << shmName
+              << " cannot be replaced: " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  int fd = shm_open(shmName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    std::cerr << "Shared memory segment " << shmName
+              << " cannot be opened: " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (ftruncate(fd, header.size) != 0) {
+    std::cerr << "Shared memory segment cannot be resized: "
+              << strerror(errno) << std::endl;
+    close(fd);
+    shm_unlink(shmName.c_str());
+    exit(EXIT_FAILURE);
+  }
+  void* addr = mmap(nullptr, header.size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "Shared memory segment cannot be mapped: "
+              << strerror(errno) << std::endl;
+    shm_unlink(shmName.c_str());
+    exit(EXIT_FAILURE);
+  }
+  char* base = (char*) addr;
+  int64_t* offsets = (int64_t*) (base + header.offsetsOffset);
+  char* words = base + header.wordsOffset;
+  real* vectors = (real*) (base + header.vectorsOffset);
+
+  Vector vec(args_->dim);
+  int64_t pos = 0;
+  for (int32_t i = 0; i < nwords; i++) {
+    std::string word = dict_->getWord(i);
+    offsets[i] = pos;
+    memcpy(words + pos, word.c_str(), word.size() + 1);
+    pos += word.size() + 1;
+    getVector(vec, word);
+    real norm = vec.norm();
+    if (norm > 0) {
+      vec.mul(1.0 / norm);
+    }
+    memcpy(vectors + i * dim, vec.data_, dim * sizeof(real));
+  }
+  // The header goes in last, and its magic after the rest of the segment
+  // is visible, so that readers checking the magic never see a partially
+  // written segment.
+  ShmHeader* published = (ShmHeader*) base;
+  const int32_t magic = header.magic;
+  header.magic = 0;
+  memcpy(published, &header, sizeof(ShmHeader));
+  __atomic_store_n(&published->magic, magic, __ATOMIC_RELEASE);
+  munmap(addr, header.size);
+  std::cerr << "Exported " << nwords << " word vectors (" << header.size
+            << " bytes) to " << shmName << std::endl;
+}
+
 void FastText::analogies(int32_t k) {
   std::string word;
   Vector buffer(args_->dim), query(args_->dim);
@@ -515,31 +1463,47 @@ void FastText::analogies(int32_t k) {
   }
 }
 
-void FastText::trainThread(int32_t threadId) {
-  std::ifstream ifs(args_->input);
-  utils::seek(ifs, threadId * utils::size(ifs) / args_->thread);
-
-  Model model(input_, output_, args_, threadId);
-  if (args_->model == model_name::sup) {
-    model.setTargetCounts(dict_->getCounts(entry_type::label));
+// Runs the training threads as tasks of the global pool. They share the
+// token count, so they must all run at the same time: the pool is grown
+// if it is smaller than -thread.
+void FastText::startThreads() {
+  start = clock();
+  tokenCount = 0;
+  if (ThreadPool::global()->size() < args_->thread) {
+    ThreadPool::setGlobalThreads(args_->thread);
+  }
+  TaskGroup threads(ThreadPool::global());
+  for (int32_t i = 1; i < args_->thread; i++) {
+    threads.run([=]() {
+      if (teacher_) {
+        distillThread(i);
+      } else {
+        trainThread(i);
+      }
+    });
+  }
+  if (teacher_) {
+    distillThread(0);
   } else {
-    model.setTargetCounts(dict_->getCounts(entry_type::word));
+    trainThread(0);
   }
+  threads.wait();
+}
+
+// Runs the epochs of a training thread over its part of the input: step
+// learns from the next line read from the input at the given learning rate,
+// and returns its number of tokens.
+void FastText::trainLoop(int32_t threadId, Model& model,
+                         std::function<int32_t(std::istream&, real)> step) {
+  std::ifstream ifs(args_->input);
+  utils::seek(ifs, threadId * utils::size(ifs) / args_->thread);
 
   const int64_t ntokens = dict_->ntokens();
   int64_t localTokenCount = 0;
-  std::vector<int32_t> line, labels;
   while (tokenCount < args_->epoch * ntokens) {
     real progress = real(tokenCount) / (args_->epoch * ntokens);
     real lr = args_->lr * (1.0 - progress);
-    localTokenCount += dict_->getLine(ifs, line, labels, model.rng);
-    if (args_->model == model_name::sup) {
-      supervised(model, lr, line, labels);
-    } else if (args_->model == model_name::cbow) {
-      cbow(model, lr, line);
-    } else if (args_->model == model_name::sg) {
-      skipgram(model, lr, line);
-    }
+    localTokenCount += step(ifs, lr);
     if (localTokenCount > args_->lrUpdateRate) {
       tokenCount += localTokenCount;
       localTokenCount = 0;
@@ -555,6 +1519,35 @@ void FastText::trainThread(int32_t threadId) {
   ifs.close();
 }
 
+void FastText::initTrainingModel(Model& model) {
+  if (basis_) {
+    model.setBasis(basis_);
+  }
+  model.setProfile(profile_);
+  if (args_->model == model_name::sup) {
+    model.setTargetCounts(dict_->getCounts(entry_type::label));
+  } else {
+    model.setTargetCounts(dict_->getCounts(entry_type::word));
+  }
+}
+
+void FastText::trainThread(int32_t threadId) {
+  Model model(input_, output_, args_, threadId);
+  initTrainingModel(model);
+  std::vector<int32_t> line, labels;
+  trainLoop(threadId, model, [&](std::istream& in, real lr) {
+    int32_t ntokens = dict_->getLine(in, line, labels, model.rng);
+    if (args_->model == model_name::sup) {
+      supervised(model, lr, line, labels);
+    } else if (args_->model == model_name::cbow) {
+      cbow(model, lr, line);
+    } else if (args_->model == model_name::sg) {
+      skipgram(model, lr, line);
+    }
+    return ntokens;
+  });
+}
+
 void FastText::loadVectors(std::string filename) {
   std::ifstream in(filename);
   std::vector<std::string> words;
@@ -595,8 +1588,11 @@ void FastText::loadVectors(std::string filename) {
   }
 }
 
-void FastText::train(std::shared_ptr<Args> args) {
+// Trains the model in memory, without saving anything.
+void FastText::trainModel(std::shared_ptr<Args> args) {
   args_ = args;
+  quant_ = false;
+  collapsed_ = false;
   dict_ = std::make_shared<Dictionary>(args_);
   if (args_->input == "-") {
     // manage expectations
@@ -608,7 +1604,16 @@ void FastText::train(std::shared_ptr<Args> args) {
     std::cerr << "Input file cannot be opened!" << std::endl;
     exit(EXIT_FAILURE);
   }
-  dict_->readFromFile(ifs);
+  if (!args_->labels.empty()) {
+    std::ifstream labels(args_->labels);
+    if (!labels.is_open()) {
+      std::cerr << "Labels file cannot be opened!" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    dict_->initHashing(labels, ifs);
+  } else {
+    dict_->readFromFile(ifs);
+  }
   ifs.close();
 
   if (args_->pretrainedVectors.size() != 0) {
@@ -618,33 +1623,121 @@ void FastText::train(std::shared_ptr<Args> args) {
     input_->uniform(1.0 / args_->dim);
   }
 
-  if (args_->model == model_name::sup) {
-    output_ = std::make_shared<Matrix>(dict_->nlabels(), args_->dim);
+  int32_t osize = args_->model == model_name::sup ? dict_->nlabels()
+                                                   : dict_->nwords();
+  if (args_->outputRank > 0) {
+    output_ = std::make_shared<Matrix>(osize, args_->outputRank);
+    basis_ = std::make_shared<Matrix>(args_->outputRank, args_->dim);
+    basis_->uniform(1.0 / std::sqrt(args_->dim));
   } else {
-    output_ = std::make_shared<Matrix>(dict_->nwords(), args_->dim);
+    output_ = std::make_shared<Matrix>(osize, args_->dim);
   }
   output_->zero();
 
-  start = clock();
-  tokenCount = 0;
-  if (args_->thread > 1) {
-    std::vector<std::thread> threads;
-    for (int32_t i = 0; i < args_->thread; i++) {
-      threads.push_back(std::thread([=]() { trainThread(i); }));
+  profile_.reset();
+  if (args_->profile > 0) {
+    profile_ = std::make_shared<RowProfile>(input_->m_, osize, args_->profile);
+  }
+  startThreads();
+  initModel();
+}
+
+// Trains a supervised model against the label distributions predicted by a
+// teacher model on the same lines, instead of their labels.
+void FastText::distill(std::shared_ptr<Args> args,
+                       std::shared_ptr<FastText> teacher) {
+  if (teacher->args_->model != model_name::sup ||
+      teacher->args_->loss == loss_name::hs) {
+    std::cerr << "The teacher should be a supervised model trained with "
+              << "softmax or negative sampling." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (args->model != model_name::sup || args->loss != loss_name::softmax ||
+      !args->labels.empty()) {
+    std::cerr << "The student should be a supervised model trained with "
+              << "softmax and a dictionary." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  teacher_ = teacher;
+  trainModel(args);
+  teacher_.reset();
+}
+
+// Same as trainThread, except that the lines are also read by the teacher
+// to get the targets of the student.
+void FastText::distillThread(int32_t threadId) {
+  Model model(input_, output_, args_, threadId);
+  initTrainingModel(model);
+
+  const FastText& teacher = *teacher_;
+  std::vector<int32_t> labelMap(dict_->nlabels());
+  for (int32_t i = 0; i < dict_->nlabels(); i++) {
+    int32_t id = teacher.dict_->getId(dict_->getLabel(i));
+    labelMap[i] = id < 0 ? -1 : id - teacher.dict_->nwords();
+  }
+  const bool qout = teacher.quant_ && teacher.args_->qout;
+  Vector teacherHidden(teacher.args_->dim);
+  Vector teacherProjected(teacher.basis_ ? teacher.basis_->m_ : 0);
+  Vector teacherOutput(qout ? teacher.qoutput_->getM() : teacher.output_->m_);
+  Vector targets(dict_->nlabels());
+
+  std::vector<int32_t> line, labels, teacherLine, teacherLabels;
+  std::string text;
+  trainLoop(threadId, model, [&](std::istream& ifs, real lr) {
+    if (!std::getline(ifs, text)) {
+      ifs.clear();
+      ifs.seekg(std::streampos(0));
+      return 0;
     }
-    for (auto it = threads.begin(); it != threads.end(); ++it) {
-      it->join();
+    text.push_back('\n');
+    std::istringstream in(text);
+    int32_t ntokens = dict_->getLine(in, line, labels, model.rng);
+    in.clear();
+    in.seekg(std::streampos(0));
+    teacher.dict_->getLine(in, teacherLine, teacherLabels, model.rng);
+    if (!line.empty() && !teacherLine.empty()) {
+      teacher.model_->computeHidden(teacherLine, teacherHidden);
+      if (teacher.basis_) {
+        teacherProjected.mul(*teacher.basis_, teacherHidden);
+        teacher.model_->computeOutputSoftmax(teacherProjected, teacherOutput);
+      } else {
+        teacher.model_->computeOutputSoftmax(teacherHidden, teacherOutput);
+      }
+      for (int32_t i = 0; i < labelMap.size(); i++) {
+        targets[i] = labelMap[i] < 0 ? 0.0 : teacherOutput[labelMap[i]];
+      }
+      model.update(line, targets, lr);
     }
-  } else {
-    trainThread(0);
-  }
-  model_ = std::make_shared<Model>(input_, output_, args_, 0);
+    return ntokens;
+  });
+}
 
-  saveModel();
-  saveVectors();
+void FastText::train(std::shared_ptr<Args> args) {
+  trainModel(args);
+
+  TaskGroup outputs(ThreadPool::global());
+  outputs.run([this]() { saveVectors(); });
   if (args_->saveOutput > 0) {
-    saveOutput();
+    outputs.run([this]() { saveOutput(); });
+  }
+  saveModel();
+  outputs.wait();
+
+  saveProfile();
+}
+
+// Writes the profile recorded during training, if any, to <output>.profile.
+void FastText::saveProfile() const {
+  if (!profile_) {
+    return;
+  }
+  std::ofstream ofs(args_->output + ".profile");
+  if (!ofs.is_open()) {
+    std::cerr << "Error opening file for saving the profile." << std::endl;
+    exit(EXIT_FAILURE);
   }
+  dumpProfile(ofs, PROFILE_TOP);
+  ofs.close();
 }
 
 int FastText::getDimension() const {
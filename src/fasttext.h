@@ -10,19 +10,29 @@
 #ifndef FASTTEXT_FASTTEXT_H
 #define FASTTEXT_FASTTEXT_H
 
-#define FASTTEXT_VERSION 11 /* Version 1a */
+#define FASTTEXT_VERSION 13 /* Version 1c */
 #define FASTTEXT_FILEFORMAT_MAGIC_INT32 793712314
+#define FASTTEXT_SHM_MAGIC_INT32 793712315
+#define FASTTEXT_SHM_VERSION 1
 
 #include <time.h>
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <queue>
 #include <set>
+#include <thread>
 
 #include "args.h"
 #include "dictionary.h"
 #include "matrix.h"
 #include "qmatrix.h"
+#include "threadpool.h"
+#include "binarymatrix.h"
 #include "model.h"
 #include "real.h"
 #include "utils.h"
@@ -30,6 +40,24 @@
 
 namespace fasttext {
 
+// Layout of the segment written by FastText::exportShm. The header is
+// followed by nwords int64 offsets (relative to wordsOffset) into a block of
+// null-terminated words, and by the nwords x dim matrix of L2-normalized
+// word vectors, stored row-major at vectorsOffset (64-byte aligned).
+// The magic is stored last, with release semantics: readers must load it
+// with acquire semantics and treat a segment without it as not ready.
+struct ShmHeader {
+  int32_t magic;
+  int32_t version;
+  int64_t nwords;
+  int64_t dim;
+  int64_t offsetsOffset;
+  int64_t wordsOffset;
+  int64_t wordsSize;
+  int64_t vectorsOffset;
+  int64_t size;
+};
+
 class FastText {
   private:
     std::shared_ptr<Args> args_;
@@ -37,26 +65,70 @@ class FastText {
 
     std::shared_ptr<Matrix> input_;
     std::shared_ptr<Matrix> output_;
+    std::shared_ptr<Matrix> basis_;
 
     std::shared_ptr<QMatrix> qinput_;
     std::shared_ptr<QMatrix> qoutput_;
 
     std::shared_ptr<Model> model_;
+    std::shared_ptr<RowProfile> profile_;
+    std::shared_ptr<FastText> teacher_;
+
+    std::thread online_;
+    std::mutex onlineMutex_;
+    std::condition_variable onlineCv_;
+    std::deque<std::string> onlineQueue_;
+    bool onlineStop_;
+    std::atomic<int64_t> onlineUpdates_;
+
+    int32_t version_;
 
     std::atomic<int64_t> tokenCount;
     clock_t start;
     void signModel(std::ostream&);
     bool checkModel(std::istream&);
+    void saveMatrix(std::ostream&, Matrix&);
+    void loadMatrix(std::istream&, Matrix&, const std::string&);
+    void loadModel(std::istream&, const std::string&);
+    void initModel();
+    void addInputRow(Vector&, int32_t) const;
+    void nnQuantized(int32_t);
+    void printNN(std::priority_queue<std::pair<real, std::string>>&, int32_t,
+                 const std::set<std::string>&) const;
+    void predictBatches(
+        std::istream&, int32_t, int32_t, int32_t,
+        std::function<void(const std::vector<std::vector<int32_t>>&,
+                           const std::vector<std::vector<int32_t>>&,
+                           const std::vector<std::vector<
+                               std::pair<real, int32_t>>>&)>);
 
     bool quant_;
+    bool collapsed_;
+
+    static const int32_t NN_RERANK_FACTOR = 20;
+    static const int32_t SAVE_BUFFER_SIZE = 1 << 22;
+    static const int32_t PROFILE_TOP = 20;
+    static const int32_t ONLINE_QUEUE_SIZE = 1 << 16;
+
+    void onlineThread(std::shared_ptr<Model>, real, int64_t);
+    void distillThread(int32_t);
+    void trainLoop(int32_t, Model&,
+                   std::function<int32_t(std::istream&, real)>);
+    void initTrainingModel(Model&);
+
+    std::string rowName(bool, int32_t,
+                        const std::vector<std::string>&) const;
 
   public:
     FastText();
+    ~FastText();
 
     void getVector(Vector&, const std::string&) const;
+    void getSentenceVector(Vector&, const std::string&) const;
     void saveVectors();
     void saveOutput();
     void saveModel();
+    void saveModel(const std::string&);
     void loadModel(std::istream&);
     void loadModel(const std::string&);
     void printInfo(real, real);
@@ -67,12 +139,27 @@ class FastText {
     void skipgram(Model&, real, const std::vector<int32_t>&);
     std::vector<int32_t> selectEmbeddings(int32_t) const;
     void quantize(std::shared_ptr<Args>);
+    void quantizeModel(std::shared_ptr<Args>);
+    void collapse();
+    void test(std::istream&, int32_t, std::vector<int64_t>&, int64_t&,
+              int64_t&);
     void test(std::istream&, int32_t);
+    void testSweep(std::istream&, int32_t);
     void predict(std::istream&, int32_t, bool);
     void predict(
         std::istream&,
         int32_t,
         std::vector<std::pair<real, std::string>>&) const;
+    void predictWindows(std::istream&, int32_t, int32_t, int32_t, bool);
+    void setScoringThreads(int32_t, int32_t);
+    void warmup(const std::string&, bool);
+    void setProfile(int32_t);
+    void startOnline(real, int64_t, const std::string&);
+    void learn(const std::string&);
+    void stopOnline();
+    int64_t onlineUpdates() const;
+    void dumpProfile(std::ostream&, int32_t) const;
+    void saveProfile() const;
     void wordVectors();
     void sentenceVectors();
     void ngramVectors(std::string);
@@ -82,10 +169,22 @@ class FastText {
     void precomputeWordVectors(Matrix&);
     void findNN(const Matrix&, const Vector&, int32_t,
                 const std::set<std::string>&);
+    void findNN(const std::vector<real>&, const Vector&, int32_t,
+                const std::set<std::string>&);
     void nn(int32_t);
+    void nn(int32_t, const BinaryMatrix&, const std::vector<std::string>&);
+    std::shared_ptr<BinaryMatrix> binaryCodes(
+        int32_t, const std::vector<std::string>&) const;
+    void saveCodes(BinaryMatrix&, const std::string&) const;
+    std::shared_ptr<BinaryMatrix> loadCodes(
+        const std::string&, const std::vector<std::string>&) const;
+    void exportShm(const std::string&);
     void analogies(int32_t);
+    void startThreads();
     void trainThread(int32_t);
+    void trainModel(std::shared_ptr<Args>);
     void train(std::shared_ptr<Args>);
+    void distill(std::shared_ptr<Args>, std::shared_ptr<FastText>);
 
     void loadVectors(std::string);
     int getDimension() const;
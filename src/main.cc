@@ -7,7 +7,17 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
 
 #include "fasttext.h"
 #include "args.h"
@@ -20,15 +30,25 @@ void printUsage() {
     << "The commands supported by fasttext are:\n\n"
     << "  supervised              train a supervised classifier\n"
     << "  quantize                quantize a model to reduce the memory usage\n"
+    << "  pipeline                train, quantize and test a classifier in memory\n"
+    << "  collapse                fold the output layer of a classifier into its inputs\n"
+    << "  distill                 train a small classifier on the predictions of a large one\n"
     << "  test                    evaluate a supervised classifier\n"
+    << "  test-sweep              evaluate a supervised classifier for several k\n"
     << "  predict                 predict most likely labels\n"
     << "  predict-prob            predict most likely labels with probabilities\n"
+    << "  predict-window          predict labels of sliding windows of lines\n"
     << "  skipgram                train a skipgram model\n"
     << "  cbow                    train a cbow model\n"
+    << "  train-batch             train the models listed in a manifest\n"
     << "  print-word-vectors      print word vectors given a trained model\n"
     << "  print-sentence-vectors  print sentence vectors given a trained model\n"
     << "  nn                      query for nearest neighbors\n"
+    << "  binarize                save binary codes of word or sentence vectors\n"
     << "  analogies               query for analogies\n"
+    << "  export-shm              export word vectors to shared memory\n"
+    << "  profile                 profile the rows accessed by predictions\n"
+    << "  online                  serve predictions while learning from feedback\n"
     << std::endl;
 }
 
@@ -38,21 +58,104 @@ void printQuantizeUsage() {
     << std::endl;
 }
 
+void printPipelineUsage() {
+  std::cerr
+    << "usage: fasttext pipeline <args>\n\n"
+    << "Trains a supervised classifier, quantizes it and evaluates it without\n"
+    << "writing or reading intermediate models. It takes the arguments of\n"
+    << "supervised and quantize, and:\n"
+    << "  -test               test data filename, evaluated before and after quantizing []\n"
+    << "  -k                  number of labels predicted by the evaluation [1]\n"
+    << "  -keep               comma-separated outputs to save among bin, vec and ftz [ftz]\n"
+    << "  -qepoch             number of epochs of -retrain [-epoch]\n"
+    << "  -qlr                learning rate of -retrain [-lr]\n"
+    << std::endl;
+}
+
+void printCollapseUsage() {
+  std::cerr
+    << "usage: fasttext collapse <model> <output>\n\n"
+    << "  <model>      model filename\n"
+    << "  <output>     output file path of the collapsed model, which can\n"
+    << "               then be quantized with quantize -output <output>\n"
+    << std::endl;
+}
+
+void printDistillUsage() {
+  std::cerr
+    << "usage: fasttext distill <args>\n\n"
+    << "Trains a student classifier on the label distributions predicted by a\n"
+    << "teacher classifier. It takes the arguments of supervised, and:\n"
+    << "  -teacher            teacher model filename []\n"
+    << "  -test               test data filename, used to compare the student\n"
+    << "                      to the teacher []\n"
+    << std::endl;
+}
+
+const char* WARMUP_USAGE =
+  "  <warmup>     (optional) -warmup <queries> [-mlock]: before serving,\n"
+  "               predict the lines of the queries file, after locking\n"
+  "               the model in memory with -mlock\n";
+
 void printTestUsage() {
   std::cerr
-    << "usage: fasttext test <model> <test-data> [<k>]\n\n"
+    << "usage: fasttext test[-sweep] <model> <test-data> [<k>] [<threads>] [<warmup>]\n\n"
     << "  <model>      model filename\n"
     << "  <test-data>  test data filename (if -, read from stdin)\n"
-    << "  <k>          (optional; 1 by default) predict top k labels\n"
+    << "  <k>          (optional; 1 by default) predict top k labels, test-sweep\n"
+    << "               reports every k up to this one in a single pass\n"
+    << "  <threads>    (optional; number of cores by default) threads used\n"
+    << WARMUP_USAGE
+    << std::endl;
+}
+
+void printProfileUsage() {
+  std::cerr
+    << "usage: fasttext profile <model> <test-data> [<period>] [<top>]\n\n"
+    << "  <model>      model filename\n"
+    << "  <test-data>  test data filename (if -, read from stdin)\n"
+    << "  <period>     (optional; 1 by default) sample one prediction out of period\n"
+    << "  <top>        (optional; 20 by default) number of hot rows printed\n"
     << std::endl;
 }
 
 void printPredictUsage() {
   std::cerr
-    << "usage: fasttext predict[-prob] <model> <test-data> [<k>]\n\n"
+    << "usage: fasttext predict[-prob] <model> <test-data> [<k>] [<threads>] [<labels>] [<warmup>]\n\n"
     << "  <model>      model filename\n"
     << "  <test-data>  test data filename (if -, read from stdin)\n"
     << "  <k>          (optional; 1 by default) predict top k labels\n"
+    << "  <threads>    (optional; number of cores by default) threads used, which\n"
+    << "               also score the labels of a single query for large models\n"
+    << "               (1 by default)\n"
+    << "  <labels>     (optional; 100000 by default) number of labels from which\n"
+    << "               the labels of a single query are scored by several threads\n"
+    << WARMUP_USAGE
+    << std::endl;
+}
+
+void printOnlineUsage() {
+  std::cerr
+    << "usage: fasttext online <model> <feedback> <test-data> <output> [<lr>] [<snapshot>] [<warmup>]\n\n"
+    << "  <model>      model filename\n"
+    << "  <feedback>   labeled examples learned while predictions are served\n"
+    << "  <test-data>  test data filename, used for the served predictions\n"
+    << "  <output>     output file path of the snapshots\n"
+    << "  <lr>         (optional; 0.05 by default) learning rate of the updates\n"
+    << "  <snapshot>   (optional; 0 by default) save the model every snapshot\n"
+    << "               examples and at the end, 0 to never save it\n"
+    << WARMUP_USAGE
+    << std::endl;
+}
+
+void printPredictWindowUsage() {
+  std::cerr
+    << "usage: fasttext predict-window[-prob] <model> <document> <window> <stride> [<k>]\n\n"
+    << "  <model>      model filename\n"
+    << "  <document>   document filename, one sentence per line (if -, read from stdin)\n"
+    << "  <window>     number of lines in each window\n"
+    << "  <stride>     number of lines between the starts of two windows\n"
+    << "  <k>          (optional; 1 by default) predict top k labels\n"
     << std::endl;
 }
 
@@ -86,6 +189,7 @@ void quantize(const std::vector<std::string>& args) {
     exit(EXIT_FAILURE);
   }
   a->parseArgs(args);
+  ThreadPool::setGlobalThreads(a->thread);
   FastText fasttext;
   fasttext.quantize(a);
   exit(0);
@@ -93,9 +197,23 @@ void quantize(const std::vector<std::string>& args) {
 
 void printNNUsage() {
   std::cout
-    << "usage: fasttext nn <model> <k>\n\n"
+    << "usage: fasttext nn <model> <k> <bits|codes> <sentences>\n\n"
     << "  <model>      model filename\n"
     << "  <k>          (optional; 10 by default) predict top k labels\n"
+    << "  <bits>       (optional; 0 by default) preselect candidates with binary codes of this size\n"
+    << "  <codes>      (optional) preselect candidates with the codes saved by binarize\n"
+    << "  <sentences>  (optional) search the lines of this file instead of the words,\n"
+    << "               with sentences as queries\n"
+    << std::endl;
+}
+
+void printBinarizeUsage() {
+  std::cerr
+    << "usage: fasttext binarize <model> <bits> <output> <sentences>\n\n"
+    << "  <model>      model filename\n"
+    << "  <bits>       size of the binary codes\n"
+    << "  <output>     output file path of the codes, saved to <output>.codes\n"
+    << "  <sentences>  (optional) encode the lines of this file instead of the words\n"
     << std::endl;
 }
 
@@ -107,8 +225,156 @@ void printAnalogiesUsage() {
     << std::endl;
 }
 
-void test(const std::vector<std::string>& args) {
-  if (args.size() < 4 || args.size() > 5) {
+void printExportShmUsage() {
+  std::cerr
+    << "usage: fasttext export-shm <model> <name>\n\n"
+    << "  <model>      model filename\n"
+    << "  <name>       name of the POSIX shared memory segment\n"
+    << std::endl;
+}
+
+void printTrainBatchUsage() {
+  std::cerr
+    << "usage: fasttext train-batch <manifest> [<threads>]\n\n"
+    << "  <manifest>   one training command per line, e.g.\n"
+    << "               supervised -input data.txt -output model\n"
+    << "  <threads>    (optional; number of cores by default) threads\n"
+    << "               shared by all the jobs, overriding their -thread\n"
+    << std::endl;
+}
+
+void pipeline(const std::vector<std::string>& args) {
+  std::vector<std::string> targs(args.begin(), args.begin() + 2);
+  targs[1] = "supervised";
+  std::string testFile;
+  int32_t k = 1;
+  int32_t qepoch = 0;
+  double qlr = 0.0;
+  std::set<std::string> keep = {"ftz"};
+  for (int32_t ai = 2; ai < args.size(); ai++) {
+    if (ai + 1 < args.size() && args[ai] == "-test") {
+      testFile = args[++ai];
+    } else if (ai + 1 < args.size() && args[ai] == "-qepoch") {
+      qepoch = std::stoi(args[++ai]);
+    } else if (ai + 1 < args.size() && args[ai] == "-qlr") {
+      qlr = std::stod(args[++ai]);
+    } else if (ai + 1 < args.size() && args[ai] == "-k") {
+      k = std::stoi(args[++ai]);
+    } else if (ai + 1 < args.size() && args[ai] == "-keep") {
+      keep.clear();
+      std::istringstream outputs(args[++ai]);
+      std::string output;
+      while (std::getline(outputs, output, ',')) {
+        if (output != "bin" && output != "vec" && output != "ftz") {
+          std::cerr << "Unknown output to keep: " << output << std::endl;
+          printPipelineUsage();
+          exit(EXIT_FAILURE);
+        }
+        keep.insert(output);
+      }
+    } else {
+      targs.push_back(args[ai]);
+    }
+  }
+  if (targs.size() < 3 || k <= 0 || qepoch < 0 || qlr < 0) {
+    printPipelineUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::ifstream ifs;
+  if (!testFile.empty()) {
+    ifs.open(testFile);
+    if (!ifs.is_open()) {
+      std::cerr << "Test file cannot be opened!" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  std::shared_ptr<Args> a = std::make_shared<Args>();
+  a->parseArgs(targs);
+  ThreadPool::setGlobalThreads(a->thread);
+  FastText fasttext;
+  fasttext.trainModel(a);
+  if (keep.count("bin")) {
+    fasttext.saveModel();
+  }
+  if (keep.count("vec")) {
+    fasttext.saveVectors();
+  }
+  if (ifs.is_open()) {
+    std::cout << "Trained model" << std::endl;
+    fasttext.test(ifs, k);
+  }
+
+  std::shared_ptr<Args> qa = std::make_shared<Args>(*a);
+  if (qepoch > 0) {
+    qa->epoch = qepoch;
+  }
+  if (qlr > 0) {
+    qa->lr = qlr;
+  }
+  fasttext.quantizeModel(qa);
+  if (keep.count("ftz")) {
+    fasttext.saveModel();
+  }
+  if (ifs.is_open()) {
+    ifs.clear();
+    ifs.seekg(0);
+    std::cout << "Quantized model" << std::endl;
+    fasttext.test(ifs, k);
+  }
+  exit(0);
+}
+
+void collapse(const std::vector<std::string>& args) {
+  if (args.size() != 4) {
+    printCollapseUsage();
+    exit(EXIT_FAILURE);
+  }
+  FastText fasttext;
+  fasttext.loadModel(args[2]);
+  fasttext.collapse();
+  fasttext.saveModel(args[3]);
+  exit(0);
+}
+
+// Removes the warm-up options from args. Returns true if -warmup was given.
+bool parseWarmup(std::vector<std::string>& args, std::string& queries,
+                 bool& lock) {
+  bool warmup = false;
+  lock = false;
+  for (size_t i = 2; i < args.size();) {
+    if (args[i] == "-warmup" && i + 1 < args.size()) {
+      warmup = true;
+      queries = args[i + 1];
+      args.erase(args.begin() + i, args.begin() + i + 2);
+    } else if (args[i] == "-mlock") {
+      lock = true;
+      args.erase(args.begin() + i);
+    } else {
+      i++;
+    }
+  }
+  if (lock && !warmup) {
+    std::cerr << "-mlock requires -warmup" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return warmup;
+}
+
+// Warms the model up if requested and reports that it is ready to serve.
+void warmup(FastText& fasttext, bool enabled, const std::string& queries,
+            bool lock) {
+  if (enabled) {
+    fasttext.warmup(queries, lock);
+    std::cerr << "Ready" << std::endl;
+  }
+}
+
+void test(std::vector<std::string> args) {
+  std::string warmupQueries;
+  bool lock;
+  bool warm = parseWarmup(args, warmupQueries, lock);
+  if (args.size() < 4 || args.size() > 6) {
     printTestUsage();
     exit(EXIT_FAILURE);
   }
@@ -116,27 +382,82 @@ void test(const std::vector<std::string>& args) {
   if (args.size() >= 5) {
     k = std::stoi(args[4]);
   }
+  if (args.size() >= 6) {
+    ThreadPool::setGlobalThreads(std::stoi(args[5]));
+  }
 
   FastText fasttext;
   fasttext.loadModel(args[2]);
+  warmup(fasttext, warm, warmupQueries, lock);
 
+  bool sweep = args[1] == "test-sweep";
   std::string infile = args[3];
   if (infile == "-") {
-    fasttext.test(std::cin, k);
+    if (sweep) {
+      fasttext.testSweep(std::cin, k);
+    } else {
+      fasttext.test(std::cin, k);
+    }
   } else {
     std::ifstream ifs(infile);
     if (!ifs.is_open()) {
       std::cerr << "Test file cannot be opened!" << std::endl;
       exit(EXIT_FAILURE);
     }
-    fasttext.test(ifs, k);
+    if (sweep) {
+      fasttext.testSweep(ifs, k);
+    } else {
+      fasttext.test(ifs, k);
+    }
     ifs.close();
   }
   exit(0);
 }
 
-void predict(const std::vector<std::string>& args) {
-  if (args.size() < 4 || args.size() > 5) {
+void profile(const std::vector<std::string>& args) {
+  if (args.size() < 4 || args.size() > 6) {
+    printProfileUsage();
+    exit(EXIT_FAILURE);
+  }
+  int32_t period = 1;
+  int32_t top = 20;
+  if (args.size() >= 5) {
+    period = std::stoi(args[4]);
+  }
+  if (args.size() >= 6) {
+    top = std::stoi(args[5]);
+  }
+  if (period <= 0 || top < 0) {
+    printProfileUsage();
+    exit(EXIT_FAILURE);
+  }
+
+  FastText fasttext;
+  fasttext.loadModel(args[2]);
+  fasttext.setProfile(period);
+
+  std::string infile = args[3];
+  if (infile == "-") {
+    fasttext.test(std::cin, 1);
+  } else {
+    std::ifstream ifs(infile);
+    if (!ifs.is_open()) {
+      std::cerr << "Test file cannot be opened!" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    fasttext.test(ifs, 1);
+    ifs.close();
+  }
+  std::cout << std::endl;
+  fasttext.dumpProfile(std::cout, top);
+  exit(0);
+}
+
+void predict(std::vector<std::string> args) {
+  std::string warmupQueries;
+  bool lock;
+  bool warm = parseWarmup(args, warmupQueries, lock);
+  if (args.size() < 4 || args.size() > 7) {
     printPredictUsage();
     exit(EXIT_FAILURE);
   }
@@ -145,9 +466,25 @@ void predict(const std::vector<std::string>& args) {
     k = std::stoi(args[4]);
   }
 
+  int32_t threshold = 100000;
+  if (args.size() >= 7) {
+    threshold = std::stoi(args[6]);
+  }
+  if (threshold < 0) {
+    printPredictUsage();
+    exit(EXIT_FAILURE);
+  }
+
   bool print_prob = args[1] == "predict-prob";
+  if (args.size() >= 6) {
+    ThreadPool::setGlobalThreads(std::stoi(args[5]));
+  }
   FastText fasttext;
   fasttext.loadModel(std::string(args[2]));
+  if (args.size() >= 6) {
+    fasttext.setScoringThreads(std::stoi(args[5]), threshold);
+  }
+  warmup(fasttext, warm, warmupQueries, lock);
 
   std::string infile(args[3]);
   if (infile == "-") {
@@ -165,6 +502,197 @@ void predict(const std::vector<std::string>& args) {
   exit(0);
 }
 
+std::vector<std::string> readLines(const std::string& filename) {
+  std::ifstream ifs(filename);
+  if (!ifs.is_open()) {
+    std::cerr << filename << " cannot be opened!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+// Serves the predictions of the queries until done returns true, at least
+// once, and returns the number of queries served per second.
+double serve(FastText& fasttext, const std::vector<std::string>& queries,
+             std::function<bool()> done) {
+  std::vector<std::pair<real, std::string>> predictions;
+  int64_t nqueries = 0;
+  auto start = std::chrono::steady_clock::now();
+  do {
+    for (auto it = queries.cbegin(); it != queries.cend(); ++it) {
+      std::istringstream in(*it);
+      fasttext.predict(in, 1, predictions);
+      nqueries++;
+    }
+  } while (!done());
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return nqueries / elapsed.count();
+}
+
+void testFile(FastText& fasttext, const std::string& filename) {
+  std::ifstream ifs(filename);
+  fasttext.test(ifs, 1);
+}
+
+void online(std::vector<std::string> args) {
+  std::string warmupQueries;
+  bool lock;
+  bool warm = parseWarmup(args, warmupQueries, lock);
+  if (args.size() < 6 || args.size() > 8) {
+    printOnlineUsage();
+    exit(EXIT_FAILURE);
+  }
+  real lr = 0.05;
+  int64_t snapshot = 0;
+  if (args.size() >= 7) {
+    lr = std::stof(args[6]);
+  }
+  if (args.size() >= 8) {
+    snapshot = std::stoll(args[7]);
+  }
+
+  FastText fasttext;
+  fasttext.loadModel(args[2]);
+  warmup(fasttext, warm, warmupQueries, lock);
+  std::vector<std::string> feedback = readLines(args[3]);
+  std::vector<std::string> queries = readLines(args[4]);
+  testFile(fasttext, args[4]);
+
+  double before = serve(fasttext, queries, []() { return true; });
+  fasttext.startOnline(lr, snapshot, args[5]);
+  auto start = std::chrono::steady_clock::now();
+  std::thread feeder([&]() {
+    for (auto it = feedback.cbegin(); it != feedback.cend(); ++it) {
+      fasttext.learn(*it);
+    }
+  });
+  double during = serve(fasttext, queries, [&]() {
+    return fasttext.onlineUpdates() >= feedback.size();
+  });
+  feeder.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  fasttext.stopOnline();
+
+  std::cerr << "Served queries/sec: " << int64_t(before) << " before, "
+            << int64_t(during) << " during the updates" << std::endl;
+  std::cerr << "Updates: " << feedback.size() << " ("
+            << int64_t(feedback.size() / elapsed.count()) << "/sec)"
+            << std::endl;
+  testFile(fasttext, args[4]);
+  exit(0);
+}
+
+int64_t fileSize(const std::string& filename) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  return ifs.is_open() ? utils::size(ifs) : 0;
+}
+
+void distill(const std::vector<std::string>& args) {
+  std::vector<std::string> sargs(args.begin(), args.begin() + 2);
+  sargs[1] = "supervised";
+  std::string teacherFile, testPath;
+  for (int32_t ai = 2; ai < args.size(); ai++) {
+    if (ai + 1 < args.size() && args[ai] == "-teacher") {
+      teacherFile = args[++ai];
+    } else if (ai + 1 < args.size() && args[ai] == "-test") {
+      testPath = args[++ai];
+    } else {
+      sargs.push_back(args[ai]);
+    }
+  }
+  if (teacherFile.empty() || sargs.size() < 3) {
+    printDistillUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::vector<std::string> queries;
+  if (!testPath.empty()) {
+    queries = readLines(testPath);
+  }
+
+  std::shared_ptr<Args> a = std::make_shared<Args>();
+  a->parseArgs(sargs);
+  ThreadPool::setGlobalThreads(a->thread);
+  auto teacher = std::make_shared<FastText>();
+  teacher->loadModel(teacherFile);
+  FastText student;
+  student.distill(a, teacher);
+  student.saveModel();
+  student.saveProfile();
+  if (queries.empty()) {
+    exit(0);
+  }
+
+  auto once = []() { return true; };
+  double teacherRate = serve(*teacher, queries, once);
+  double studentRate = serve(student, queries, once);
+  std::vector<std::pair<real, std::string>> tpred, spred;
+  int64_t nexamples = 0, agree = 0;
+  for (auto it = queries.cbegin(); it != queries.cend(); ++it) {
+    std::istringstream tin(*it), sin(*it);
+    teacher->predict(tin, 1, tpred);
+    student.predict(sin, 1, spred);
+    if (!tpred.empty() && !spred.empty()) {
+      nexamples++;
+      agree += tpred[0].second == spred[0].second;
+    }
+  }
+  std::streamsize precision = std::cout.precision(3);
+  std::cout << "Size\t" << fileSize(teacherFile) << "\t"
+            << fileSize(a->output + ".bin") << std::endl;
+  std::cout << "Latency (us)\t" << 1e6 / teacherRate << "\t"
+            << 1e6 / studentRate << std::endl;
+  std::cout << "Agreement@1\t" << double(agree) / nexamples << std::endl;
+  std::cout.precision(precision);
+  std::cout << "Teacher" << std::endl;
+  testFile(*teacher, testPath);
+  std::cout << "Student" << std::endl;
+  testFile(student, testPath);
+  exit(0);
+}
+
+void predictWindow(const std::vector<std::string>& args) {
+  if (args.size() < 6 || args.size() > 7) {
+    printPredictWindowUsage();
+    exit(EXIT_FAILURE);
+  }
+  int32_t window = std::stoi(args[4]);
+  int32_t stride = std::stoi(args[5]);
+  if (window <= 0 || stride <= 0) {
+    printPredictWindowUsage();
+    exit(EXIT_FAILURE);
+  }
+  int32_t k = 1;
+  if (args.size() >= 7) {
+    k = std::stoi(args[6]);
+  }
+
+  bool print_prob = args[1] == "predict-window-prob";
+  FastText fasttext;
+  fasttext.loadModel(std::string(args[2]));
+
+  std::string infile(args[3]);
+  if (infile == "-") {
+    fasttext.predictWindows(std::cin, window, stride, k, print_prob);
+  } else {
+    std::ifstream ifs(infile);
+    if (!ifs.is_open()) {
+      std::cerr << "Input file cannot be opened!" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    fasttext.predictWindows(ifs, window, stride, k, print_prob);
+    ifs.close();
+  }
+
+  exit(0);
+}
+
 void printWordVectors(const std::vector<std::string> args) {
   if (args.size() != 3) {
     printPrintWordVectorsUsage();
@@ -199,18 +727,65 @@ void printNgrams(const std::vector<std::string> args) {
 }
 
 void nn(const std::vector<std::string> args) {
-  int32_t k;
-  if (args.size() == 3) {
-    k = 10;
-  } else if (args.size() == 4) {
+  if (args.size() < 3 || args.size() > 6) {
+    printNNUsage();
+    exit(EXIT_FAILURE);
+  }
+  int32_t k = 10;
+  if (args.size() >= 4) {
     k = std::stoi(args[3]);
+  }
+  std::string codesFile;
+  int32_t bits = 0;
+  if (args.size() >= 5) {
+    if (args[4].find_first_not_of("0123456789") == std::string::npos) {
+      bits = std::stoi(args[4]);
+    } else {
+      codesFile = args[4];
+    }
+  }
+  std::vector<std::string> sentences;
+  if (args.size() >= 6) {
+    sentences = readLines(args[5]);
+  }
+  FastText fasttext;
+  fasttext.loadModel(std::string(args[2]));
+  if (codesFile.empty() && bits == 0) {
+    if (!sentences.empty()) {
+      std::cerr << "Searching sentences requires binary codes." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    fasttext.nn(k);
   } else {
-    printNNUsage();
+    std::shared_ptr<BinaryMatrix> codes;
+    if (codesFile.empty()) {
+      codes = fasttext.binaryCodes(bits, sentences);
+    } else {
+      codes = fasttext.loadCodes(codesFile, sentences);
+    }
+    fasttext.nn(k, *codes, sentences);
+  }
+  exit(0);
+}
+
+void binarize(const std::vector<std::string> args) {
+  if (args.size() < 5 || args.size() > 6) {
+    printBinarizeUsage();
     exit(EXIT_FAILURE);
   }
+  int32_t bits = std::stoi(args[3]);
+  if (bits <= 0) {
+    printBinarizeUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::vector<std::string> sentences;
+  if (args.size() >= 6) {
+    sentences = readLines(args[5]);
+  }
   FastText fasttext;
   fasttext.loadModel(std::string(args[2]));
-  fasttext.nn(k);
+  auto codes = fasttext.binaryCodes(bits, sentences);
+  fasttext.saveCodes(*codes, args[4] + ".codes");
   exit(0);
 }
 
@@ -230,13 +805,151 @@ void analogies(const std::vector<std::string> args) {
   exit(0);
 }
 
+void exportShm(const std::vector<std::string> args) {
+  if (args.size() != 4) {
+    printExportShmUsage();
+    exit(EXIT_FAILURE);
+  }
+  FastText fasttext;
+  fasttext.loadModel(std::string(args[2]));
+  fasttext.exportShm(std::string(args[3]));
+  exit(0);
+}
+
 void train(const std::vector<std::string> args) {
   std::shared_ptr<Args> a = std::make_shared<Args>();
   a->parseArgs(args);
+  ThreadPool::setGlobalThreads(a->thread);
   FastText fasttext;
   fasttext.train(a);
 }
 
+struct TrainJob {
+  std::shared_ptr<Args> args;
+  int64_t size;
+};
+
+// Returns why training would fail before reading the input of the job, or
+// an empty string if it can be started.
+std::string checkJob(const Args& args) {
+  if (args.input == "-") {
+    return "cannot use stdin for training";
+  }
+  std::ifstream input(args.input);
+  if (!input.is_open()) {
+    return "input file " + args.input + " cannot be opened";
+  }
+  if (!args.labels.empty() && !std::ifstream(args.labels).is_open()) {
+    return "labels file " + args.labels + " cannot be opened";
+  }
+  if (!args.pretrainedVectors.empty()) {
+    std::ifstream vectors(args.pretrainedVectors);
+    int64_t n, dim;
+    if (!(vectors >> n >> dim)) {
+      return "pretrained vectors file " + args.pretrainedVectors +
+             " cannot be read";
+    }
+    if (dim != args.dim) {
+      return "dimension of pretrained vectors does not match -dim option";
+    }
+  }
+  std::string::size_type slash = args.output.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." :
+                    args.output.substr(0, std::max<size_t>(slash, 1));
+  if (access(dir.c_str(), W_OK) != 0) {
+    return "output directory " + dir + " is not writable";
+  }
+  return "";
+}
+
+// Trains all the jobs of a manifest concurrently as tasks of the global
+// pool, which is sized by the thread budget. Jobs are started from the
+// largest input to the smallest one, and each one gets a share of the
+// budget proportional to its part of the input that remains to be trained
+// on. Jobs that could not be started are reported and skipped, without
+// stopping the others.
+void trainBatch(const std::vector<std::string> args) {
+  int32_t nthreads;
+  if (args.size() == 3) {
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+  } else if (args.size() == 4) {
+    nthreads = std::max(1, std::stoi(args[3]));
+  } else {
+    printTrainBatchUsage();
+    exit(EXIT_FAILURE);
+  }
+  std::ifstream ifs(args[2]);
+  if (!ifs.is_open()) {
+    std::cerr << "Manifest file cannot be opened!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::vector<TrainJob> jobs;
+  int64_t remaining = 0;
+  int32_t failed = 0;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::vector<std::string> jobArgs(1, args[0]);
+    std::string token;
+    while (iss >> token) {
+      jobArgs.push_back(token);
+    }
+    if (jobArgs.size() < 2 || jobArgs[1][0] == '#') continue;
+    if (jobArgs[1] != "supervised" && jobArgs[1] != "skipgram" &&
+        jobArgs[1] != "cbow") {
+      std::cerr << "Unknown training command: " << jobArgs[1] << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    TrainJob job;
+    job.args = std::make_shared<Args>();
+    job.args->parseArgs(jobArgs);
+    std::string error = checkJob(*job.args);
+    if (!error.empty()) {
+      std::cerr << "Skipping " << job.args->output << ": " << error
+                << std::endl;
+      failed++;
+      continue;
+    }
+    std::ifstream input(job.args->input);
+    job.size = utils::size(input);
+    remaining += job.size;
+    jobs.push_back(job);
+  }
+  std::sort(jobs.begin(), jobs.end(),
+      [](const TrainJob& j1, const TrainJob& j2) {
+      return j1.size > j2.size;
+      });
+
+  ThreadPool::setGlobalThreads(nthreads);
+  std::mutex mutex;
+  TaskGroup group(ThreadPool::global());
+  for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+    int64_t share = (nthreads * it->size + remaining - 1) /
+                    std::max(remaining, int64_t(1));
+    int32_t threads = std::min(int64_t(nthreads), std::max(share, int64_t(1)));
+    remaining -= it->size;
+    it->args->thread = threads;
+    // Progress lines of concurrent jobs would overwrite each other.
+    it->args->verbose = std::min(it->args->verbose, 1);
+    std::shared_ptr<Args> jobArgs = it->args;
+    group.run([&mutex, jobArgs, threads]() {
+      FastText fasttext;
+      fasttext.train(jobArgs);
+      if (jobArgs->verbose > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cerr << "Trained " << jobArgs->output << " with " << threads
+                  << " threads" << std::endl;
+      }
+    });
+  }
+  group.wait();
+  if (failed > 0) {
+    std::cerr << failed << " of " << jobs.size() + failed
+              << " jobs were skipped" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
 int main(int argc, char** argv) {
   std::vector<std::string> args(argv, argv + argc);
   if (args.size() < 2) {
@@ -246,8 +959,16 @@ int main(int argc, char** argv) {
   std::string command(args[1]);
   if (command == "skipgram" || command == "cbow" || command == "supervised") {
     train(args);
-  } else if (command == "test") {
+  } else if (command == "train-batch") {
+    trainBatch(args);
+  } else if (command == "test" || command == "test-sweep") {
     test(args);
+  } else if (command == "pipeline") {
+    pipeline(args);
+  } else if (command == "collapse") {
+    collapse(args);
+  } else if (command == "distill") {
+    distill(args);
   } else if (command == "quantize") {
     quantize(args);
   } else if (command == "print-word-vectors") {
@@ -258,10 +979,20 @@ int main(int argc, char** argv) {
     printNgrams(args);
   } else if (command == "nn") {
     nn(args);
+  } else if (command == "binarize") {
+    binarize(args);
   } else if (command == "analogies") {
     analogies(args);
+  } else if (command == "online") {
+    online(args);
+  } else if (command == "profile") {
+    profile(args);
+  } else if (command == "export-shm") {
+    exportShm(args);
   } else if (command == "predict" || command == "predict-prob" ) {
     predict(args);
+  } else if (command == "predict-window" || command == "predict-window-prob") {
+    predictWindow(args);
   } else {
     printUsage();
     exit(EXIT_FAILURE);
@@ -11,8 +11,18 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
 #include <random>
+#include <vector>
 
+#ifdef FASTTEXT_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "threadpool.h"
 #include "utils.h"
 #include "vector.h"
 
@@ -122,9 +132,11 @@ real Matrix::l2NormRow(int64_t i) const {
 
 void Matrix::l2NormRow(Vector& norms) const {
   assert(norms.size() == m_);
-    for (auto i = 0; i < m_; i++) {
+  ThreadPool::global()->parallelFor(0, m_, [&](int64_t begin, int64_t end) {
+    for (auto i = begin; i < end; i++) {
       norms[i] = l2NormRow(i);
     }
+  }, 4096);
 }
 
 void Matrix::save(std::ostream& out) {
@@ -141,4 +153,145 @@ void Matrix::load(std::istream& in) {
   in.read((char*) data_, m_ * n_ * sizeof(real));
 }
 
+void Matrix::load(std::istream& in, const std::string& filename) {
+  in.read((char*) &m_, sizeof(int64_t));
+  in.read((char*) &n_, sizeof(int64_t));
+  delete[] data_;
+  data_ = new real[m_ * n_];
+  const int64_t size = m_ * n_ * sizeof(real);
+  const int64_t offset = in.tellg();
+  auto pool = ThreadPool::global();
+  const int64_t nparts = std::max<int64_t>(
+      1, std::min<int64_t>(pool->size(), size / MIN_READ_SIZE));
+  if (filename.empty() || offset < 0 || nparts == 1) {
+    in.read((char*) data_, size);
+    return;
+  }
+  const int64_t chunk = (size + nparts - 1) / nparts;
+  std::atomic<bool> failed(false);
+  pool->parallelFor(0, nparts, [&](int64_t pbegin, int64_t pend) {
+    for (int64_t p = pbegin; p < pend; p++) {
+      const int64_t begin = p * chunk;
+      const int64_t end = std::min(size, begin + chunk);
+      std::ifstream ifs(filename, std::ifstream::binary);
+      ifs.seekg(offset + begin);
+      ifs.read((char*) data_ + begin, end - begin);
+      if (ifs.gcount() != end - begin) {
+        failed = true;
+      }
+    }
+  });
+  if (failed) {
+    std::cerr << "Matrix cannot be read from " << filename << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  in.seekg(offset + size);
+}
+
+// Compressed matrices are stored as independent frames of FRAME_SIZE
+// values. Each frame is byte-shuffled (all first bytes of the floats, then
+// all second bytes, ...) before being deflated, which groups the slowly
+// varying exponent bytes together.
+void shuffleBytes(const real* src, int64_t count, uint8_t* dst) {
+  const uint8_t* bytes = (const uint8_t*) src;
+  for (int64_t i = 0; i < count; i++) {
+    for (size_t b = 0; b < sizeof(real); b++) {
+      dst[b * count + i] = bytes[i * sizeof(real) + b];
+    }
+  }
+}
+
+void unshuffleBytes(const uint8_t* src, int64_t count, real* dst) {
+  uint8_t* bytes = (uint8_t*) dst;
+  for (int64_t i = 0; i < count; i++) {
+    for (size_t b = 0; b < sizeof(real); b++) {
+      bytes[i * sizeof(real) + b] = src[b * count + i];
+    }
+  }
+}
+
+template <typename F>
+void runFrames(int64_t nframes, F frame) {
+  ThreadPool::global()->parallelFor(0, nframes, [&](int64_t begin,
+                                                    int64_t end) {
+    for (int64_t f = begin; f < end; f++) {
+      frame(f);
+    }
+  });
+}
+
+#ifdef FASTTEXT_USE_ZLIB
+void Matrix::saveCompressed(std::ostream& out, int32_t level) {
+  const int64_t rows = std::max<int64_t>(1, FRAME_SIZE / std::max<int64_t>(n_, 1));
+  const int64_t nframes = (m_ + rows - 1) / rows;
+  std::vector<std::vector<uint8_t>> frames(nframes);
+  runFrames(nframes, [&](int64_t f) {
+    const int64_t count = std::min(rows, m_ - f * rows) * n_;
+    std::vector<uint8_t> shuffled(count * sizeof(real));
+    shuffleBytes(data_ + f * rows * n_, count, shuffled.data());
+    uLongf size = compressBound(shuffled.size());
+    frames[f].resize(size);
+    if (compress2(frames[f].data(), &size, shuffled.data(), shuffled.size(),
+                  level) != Z_OK) {
+      std::cerr << "Matrix compression failed!" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    frames[f].resize(size);
+  });
+  out.write((char*) &m_, sizeof(int64_t));
+  out.write((char*) &n_, sizeof(int64_t));
+  out.write((char*) &rows, sizeof(int64_t));
+  out.write((char*) &nframes, sizeof(int64_t));
+  for (int64_t f = 0; f < nframes; f++) {
+    int64_t size = frames[f].size();
+    out.write((char*) &size, sizeof(int64_t));
+  }
+  for (int64_t f = 0; f < nframes; f++) {
+    out.write((char*) frames[f].data(), frames[f].size());
+  }
+}
+
+void Matrix::loadCompressed(std::istream& in) {
+  int64_t rows, nframes;
+  in.read((char*) &m_, sizeof(int64_t));
+  in.read((char*) &n_, sizeof(int64_t));
+  in.read((char*) &rows, sizeof(int64_t));
+  in.read((char*) &nframes, sizeof(int64_t));
+  std::vector<int64_t> offsets(nframes + 1, 0);
+  for (int64_t f = 0; f < nframes; f++) {
+    in.read((char*) &offsets[f + 1], sizeof(int64_t));
+    offsets[f + 1] += offsets[f];
+  }
+  std::vector<uint8_t> frames(offsets[nframes]);
+  in.read((char*) frames.data(), frames.size());
+  delete[] data_;
+  data_ = new real[m_ * n_];
+  runFrames(nframes, [&](int64_t f) {
+    const int64_t count = std::min(rows, m_ - f * rows) * n_;
+    std::vector<uint8_t> shuffled(count * sizeof(real));
+    uLongf size = shuffled.size();
+    if (uncompress(shuffled.data(), &size, frames.data() + offsets[f],
+                   offsets[f + 1] - offsets[f]) != Z_OK ||
+        size != shuffled.size()) {
+      std::cerr << "Matrix decompression failed!" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    unshuffleBytes(shuffled.data(), count, data_ + f * rows * n_);
+  });
+}
+#else
+void Matrix::saveCompressed(std::ostream&, int32_t) {
+  std::cerr << "fastText was built without compression support "
+            << "(rebuild with ZLIB=1)." << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+void Matrix::loadCompressed(std::istream&) {
+  std::cerr << "Model contains compressed matrices but fastText was built "
+            << "without compression support (rebuild with ZLIB=1)."
+            << std::endl;
+  exit(EXIT_FAILURE);
+}
+#endif
+
 }
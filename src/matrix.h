@@ -13,6 +13,7 @@
 #include <cstdint>
 #include <istream>
 #include <ostream>
+#include <string>
 
 #include "real.h"
 
@@ -21,6 +22,9 @@ namespace fasttext {
 class Vector;
 
 class Matrix {
+  private:
+    static const int64_t FRAME_SIZE = 1 << 20;
+    static const int64_t MIN_READ_SIZE = 1 << 26;
 
   public:
     real* data_;
@@ -50,6 +54,9 @@ class Matrix {
 
     void save(std::ostream&);
     void load(std::istream&);
+    void load(std::istream&, const std::string&);
+    void saveCompressed(std::ostream&, int32_t);
+    void loadCompressed(std::istream&);
 };
 
 }
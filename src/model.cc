@@ -12,21 +12,124 @@
 #include <iostream>
 #include <assert.h>
 #include <algorithm>
+#include <cmath>
+#include <functional>
+
+#include "threadpool.h"
 
 namespace fasttext {
 
+namespace {
+
+// Each thread decides on its own which calls are sampled, and remembers the
+// model of the sampled call: other models may run on the same thread in the
+// meantime, e.g. a teacher during distillation.
+thread_local uint32_t profileTick = 0;
+thread_local const Model* profileSampled = nullptr;
+
+}
+
+RowProfile::RowProfile(int64_t inputRows, int64_t outputRows, int32_t period)
+  : period_(std::max(1, period)), samples_(0), input_(inputRows),
+    output_(outputRows) {
+  for (auto it = input_.begin(); it != input_.end(); ++it) {
+    it->store(0);
+  }
+  for (auto it = output_.begin(); it != output_.end(); ++it) {
+    it->store(0);
+  }
+}
+
+int32_t RowProfile::period() const {
+  return period_;
+}
+
+int64_t RowProfile::samples() const {
+  return samples_;
+}
+
+void RowProfile::addSample() {
+  samples_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RowProfile::addInput(int64_t i) {
+  if (i >= 0 && i < input_.size()) {
+    input_[i].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void RowProfile::addOutput(int64_t i) {
+  if (i >= 0 && i < output_.size()) {
+    output_[i].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+std::vector<uint32_t> RowProfile::inputCounts() const {
+  std::vector<uint32_t> counts;
+  for (auto it = input_.cbegin(); it != input_.cend(); ++it) {
+    counts.push_back(*it);
+  }
+  return counts;
+}
+
+std::vector<uint32_t> RowProfile::outputCounts() const {
+  std::vector<uint32_t> counts;
+  for (auto it = output_.cbegin(); it != output_.cend(); ++it) {
+    counts.push_back(*it);
+  }
+  return counts;
+}
+
+const int32_t RowLocks::DEFAULT_STRIPES;
+
+RowLocks::RowLocks(int32_t stripes) : seq_(stripes) {
+  for (auto it = seq_.begin(); it != seq_.end(); ++it) {
+    it->store(0);
+  }
+}
+
+void RowLocks::beginWrite(int64_t row) {
+  std::atomic<uint32_t>& seq = seq_[row % seq_.size()];
+  seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void RowLocks::endWrite(int64_t row) {
+  std::atomic<uint32_t>& seq = seq_[row % seq_.size()];
+  seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+uint32_t RowLocks::beginRead(int64_t row) const {
+  const std::atomic<uint32_t>& seq = seq_[row % seq_.size()];
+  uint32_t s = seq.load(std::memory_order_acquire);
+  while (s & 1) {
+    s = seq.load(std::memory_order_acquire);
+  }
+  return s;
+}
+
+bool RowLocks::endRead(int64_t row, uint32_t s) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return seq_[row % seq_.size()].load(std::memory_order_relaxed) == s;
+}
+
 Model::Model(std::shared_ptr<Matrix> wi,
              std::shared_ptr<Matrix> wo,
              std::shared_ptr<Args> args,
              int32_t seed)
-  : hidden_(args->dim), output_(wo->m_),
-  grad_(args->dim), rng(seed), quant_(false)
+  : hidden_(args->outputRank > 0 ? args->outputRank : args->dim),
+  output_(wo->m_),
+  grad_(args->outputRank > 0 ? args->outputRank : args->dim),
+  ihidden_(args->dim), igrad_(args->dim),
+  scoringThreads_(1), scoringThreshold_(100000),
+  rng(seed), quant_(false)
 {
   wi_ = wi;
   wo_ = wo;
   args_ = args;
   osz_ = wo->m_;
   hsz_ = args->dim;
+  collapsed_ = false;
   negpos = 0;
   loss_ = 0.0;
   nexamples_ = 1;
@@ -48,11 +151,119 @@ void Model::setQuantizePointer(std::shared_ptr<QMatrix> qwi,
   }
 }
 
+// The output layer is factorized as wo_ * basis_, where basis_ is a
+// rank x dim matrix shared by all the output rows. The losses then work
+// on the projection of the hidden vector on the basis.
+void Model::setBasis(std::shared_ptr<Matrix> basis) {
+  assert(basis->m_ == hidden_.size() && basis->n_ == hsz_);
+  basis_ = basis;
+}
+
+void Model::setProfile(std::shared_ptr<RowProfile> profile) {
+  profile_ = profile;
+}
+
+// In a collapsed model, the rows of the input matrix already hold the
+// output scores, see FastText::collapse: the hidden vector is the output.
+void Model::setCollapsed(bool collapsed) {
+  assert(!collapsed || hsz_ == osz_);
+  collapsed_ = collapsed;
+}
+
+// The locks are only needed when the matrices are updated while other
+// threads predict, see FastText::startOnline.
+void Model::setLocks(std::shared_ptr<RowLocks> input,
+                     std::shared_ptr<RowLocks> output) {
+  inputLocks_ = input;
+  outputLocks_ = output;
+}
+
+void Model::addInputRow(Vector& hidden, int32_t i) const {
+  if (!inputLocks_) {
+    hidden.addRow(*wi_, i);
+    return;
+  }
+  thread_local std::vector<real> row;
+  row.resize(wi_->n_);
+  const real* data = wi_->data_ + int64_t(i) * wi_->n_;
+  uint32_t s;
+  do {
+    s = inputLocks_->beginRead(i);
+    std::copy(data, data + wi_->n_, row.begin());
+  } while (!inputLocks_->endRead(i, s));
+  for (int64_t j = 0; j < wi_->n_; j++) {
+    hidden[j] += row[j];
+  }
+}
+
+real Model::dotOutputRow(const Vector& hidden, int32_t i) const {
+  if (collapsed_) {
+    return hidden[i];
+  }
+  if (quant_ && args_->qout) {
+    return qwo_->dotRow(hidden, i);
+  }
+  if (!outputLocks_) {
+    return wo_->dotRow(hidden, i);
+  }
+  uint32_t s;
+  real d;
+  do {
+    s = outputLocks_->beginRead(i);
+    d = wo_->dotRow(hidden, i);
+  } while (!outputLocks_->endRead(i, s));
+  return d;
+}
+
+void Model::updateInputRow(const Vector& grad, int32_t i) {
+  if (inputLocks_) {
+    inputLocks_->beginWrite(i);
+  }
+  wi_->addRow(grad, i, 1.0);
+  if (inputLocks_) {
+    inputLocks_->endWrite(i);
+  }
+}
+
+void Model::updateOutputRow(const Vector& hidden, int32_t i, real a) {
+  if (outputLocks_) {
+    outputLocks_->beginWrite(i);
+  }
+  wo_->addRow(hidden, i, a);
+  if (outputLocks_) {
+    outputLocks_->endWrite(i);
+  }
+}
+
+bool Model::sampleProfile() const {
+  bool sampled = profile_ && ++profileTick % profile_->period() == 0;
+  profileSampled = sampled ? this : nullptr;
+  if (sampled) {
+    profile_->addSample();
+  }
+  return sampled;
+}
+
+void Model::profileOutput(int32_t i) const {
+  if (profileSampled == this) {
+    profile_->addOutput(i);
+  }
+}
+
+void Model::profileAllOutputs() const {
+  if (profileSampled == this) {
+    for (int32_t i = 0; i < osz_; i++) {
+      profile_->addOutput(i);
+    }
+  }
+}
+
 real Model::binaryLogistic(int32_t target, bool label, real lr) {
+  profileOutput(target);
   real score = sigmoid(wo_->dotRow(hidden_, target));
   real alpha = lr * (real(label) - score);
   grad_.addRow(*wo_, target, alpha);
-  wo_->addRow(hidden_, target, alpha);
+  updateOutputRow(hidden_, target, alpha);
   if (label) {
     return -log(score);
   } else {
@@ -85,8 +296,16 @@ real Model::hierarchicalSoftmax(int32_t target, real lr) {
 }
 
 void Model::computeOutputSoftmax(Vector& hidden, Vector& output) const {
-  if (quant_ && args_->qout) {
+  if (collapsed_) {
+    for (int32_t i = 0; i < osz_; i++) {
+      output[i] = hidden[i];
+    }
+  } else if (quant_ && args_->qout) {
     output.mul(*qwo_, hidden);
+  } else if (outputLocks_) {
+    for (int32_t i = 0; i < osz_; i++) {
+      output[i] = dotOutputRow(hidden, i);
+    }
   } else {
     output.mul(*wo_, hidden);
   }
@@ -109,24 +328,46 @@ void Model::computeOutputSoftmax() {
 
 real Model::softmax(int32_t target, real lr) {
   grad_.zero();
+  profileAllOutputs();
   computeOutputSoftmax();
   for (int32_t i = 0; i < osz_; i++) {
     real label = (i == target) ? 1.0 : 0.0;
     real alpha = lr * (label - output_[i]);
     grad_.addRow(*wo_, i, alpha);
-    wo_->addRow(hidden_, i, alpha);
+    updateOutputRow(hidden_, i, alpha);
   }
   return -log(output_[target]);
 }
 
+// Softmax loss against a distribution over the outputs instead of a single
+// target, e.g. the predictions of a teacher model.
+real Model::softmax(const Vector& targets, real lr) {
+  grad_.zero();
+  profileAllOutputs();
+  computeOutputSoftmax();
+  real loss = 0.0;
+  for (int32_t i = 0; i < osz_; i++) {
+    real alpha = lr * (targets[i] - output_[i]);
+    grad_.addRow(*wo_, i, alpha);
+    updateOutputRow(hidden_, i, alpha);
+    if (targets[i] > 0) {
+      loss -= targets[i] * log(output_[i]);
+    }
+  }
+  return loss;
+}
+
 void Model::computeHidden(const std::vector<int32_t>& input, Vector& hidden) const {
   assert(hidden.size() == hsz_);
   hidden.zero();
   for (auto it = input.cbegin(); it != input.cend(); ++it) {
+    if (profileSampled == this) {
+      profile_->addInput(*it);
+    }
     if(quant_) {
       hidden.addRow(*qwi_, *it);
     } else {
-      hidden.addRow(*wi_, *it);
+      addInputRow(hidden, *it);
     }
   }
   hidden.mul(1.0 / input.size());
@@ -140,10 +381,25 @@ bool Model::comparePairs(const std::pair<real, int32_t> &l,
 void Model::predict(const std::vector<int32_t>& input, int32_t k,
                     std::vector<std::pair<real, int32_t>>& heap,
                     Vector& hidden, Vector& output) const {
+  sampleProfile();
+  computeHidden(input, hidden);
+  predictFromHidden(k, heap, hidden, output);
+}
+
+void Model::predictFromHidden(int32_t k,
+                              std::vector<std::pair<real, int32_t>>& heap,
+                              Vector& hidden, Vector& output) const {
   assert(k > 0);
   heap.reserve(k + 1);
-  computeHidden(input, hidden);
-  if (args_->loss == loss_name::hs) {
+  if (basis_) {
+    Vector projected(basis_->m_);
+    projected.mul(*basis_, hidden);
+    if (args_->loss == loss_name::hs) {
+      dfs(k, 2 * osz_ - 2, 0.0, heap, projected);
+    } else {
+      findKBest(k, heap, projected, output);
+    }
+  } else if (args_->loss == loss_name::hs) {
     dfs(k, 2 * osz_ - 2, 0.0, heap, hidden);
   } else {
     findKBest(k, heap, hidden, output);
@@ -153,23 +409,125 @@ void Model::predict(const std::vector<int32_t>& input, int32_t k,
 
 void Model::predict(const std::vector<int32_t>& input, int32_t k,
                     std::vector<std::pair<real, int32_t>>& heap) {
-  predict(input, k, heap, hidden_, output_);
+  predict(input, k, heap, ihidden_, output_);
+}
+
+void Model::pushKBest(int32_t k, real score, int32_t i,
+                      std::vector<std::pair<real, int32_t>>& heap) {
+  if (heap.size() == k && score < heap.front().first) {
+    return;
+  }
+  heap.push_back(std::make_pair(score, i));
+  std::push_heap(heap.begin(), heap.end(), comparePairs);
+  if (heap.size() > k) {
+    std::pop_heap(heap.begin(), heap.end(), comparePairs);
+    heap.pop_back();
+  }
+}
+
+// Predicts the inputs of a batch in [begin, end), prefetching the input
+// rows of the next query while the current one is being scored.
+void Model::predict(const std::vector<std::vector<int32_t>>& inputs,
+                    int64_t begin, int64_t end, int32_t k,
+                    std::vector<std::vector<std::pair<real, int32_t>>>& heaps,
+                    Vector& hidden, Vector& output) const {
+  assert(heaps.size() >= end);
+  if (begin < end) {
+    prefetchRows(inputs[begin]);
+  }
+  for (int64_t q = begin; q < end; q++) {
+    if (q + 1 < end) {
+      prefetchRows(inputs[q + 1]);
+    }
+    heaps[q].clear();
+    if (!inputs[q].empty()) {
+      predict(inputs[q], k, heaps[q], hidden, output);
+    }
+  }
+}
+
+void Model::prefetchRows(const std::vector<int32_t>& input) const {
+  if (quant_) return;
+  const int64_t lineSize = 64 / sizeof(real);
+  for (auto it = input.cbegin(); it != input.cend(); ++it) {
+    const real* row = wi_->data_ + *it * wi_->n_;
+    for (int64_t j = 0; j < wi_->n_; j += lineSize) {
+      __builtin_prefetch(row + j);
+    }
+  }
 }
 
 void Model::findKBest(int32_t k, std::vector<std::pair<real, int32_t>>& heap,
                       Vector& hidden, Vector& output) const {
+  profileAllOutputs();
+  if (scoringThreads_ > 1 && osz_ >= scoringThreshold_) {
+    findKBestParallel(k, heap, hidden, output);
+    return;
+  }
   computeOutputSoftmax(hidden, output);
   for (int32_t i = 0; i < osz_; i++) {
-    if (heap.size() == k && log(output[i]) < heap.front().first) {
-      continue;
+    pushKBest(k, log(output[i]), i, heap);
+  }
+}
+
+// Splits the output rows in contiguous shards. Each shard computes its
+// scores and a local softmax normalizer, which are then combined before
+// every shard selects its own k best labels. The shard heaps are merged
+// at the end.
+void Model::findKBestParallel(int32_t k,
+                              std::vector<std::pair<real, int32_t>>& heap,
+                              Vector& hidden, Vector& output) const {
+  const int32_t nshards = scoringThreads_;
+  const int32_t shardSize = (osz_ + nshards - 1) / nshards;
+  std::vector<real> maxs(nshards), sums(nshards);
+  std::vector<std::vector<std::pair<real, int32_t>>> heaps(nshards);
+  auto runShards = [nshards](std::function<void(int32_t)> shard) {
+    TaskGroup group(ThreadPool::global());
+    for (int32_t s = 1; s < nshards; s++) {
+      group.run([&shard, s]() { shard(s); });
+    }
+    shard(0);
+    group.wait();
+  };
+  runShards([&](int32_t s) {
+    const int32_t begin = std::min(osz_, s * shardSize);
+    const int32_t end = std::min(osz_, begin + shardSize);
+    real max = -1e30, z = 0.0;
+    for (int32_t i = begin; i < end; i++) {
+      output[i] = dotOutputRow(hidden, i);
+      max = std::max(output[i], max);
     }
-    heap.push_back(std::make_pair(log(output[i]), i));
-    std::push_heap(heap.begin(), heap.end(), comparePairs);
-    if (heap.size() > k) {
-      std::pop_heap(heap.begin(), heap.end(), comparePairs);
-      heap.pop_back();
+    for (int32_t i = begin; i < end; i++) {
+      output[i] = exp(output[i] - max);
+      z += output[i];
     }
+    maxs[s] = max;
+    sums[s] = z;
+  });
+  real max = *std::max_element(maxs.begin(), maxs.end()), z = 0.0;
+  for (int32_t s = 0; s < nshards; s++) {
+    z += sums[s] * exp(maxs[s] - max);
   }
+  runShards([&](int32_t s) {
+    const int32_t begin = std::min(osz_, s * shardSize);
+    const int32_t end = std::min(osz_, begin + shardSize);
+    const real scale = exp(maxs[s] - max) / z;
+    heaps[s].reserve(k + 1);
+    for (int32_t i = begin; i < end; i++) {
+      output[i] *= scale;
+      pushKBest(k, log(output[i]), i, heaps[s]);
+    }
+  });
+  for (int32_t s = 0; s < nshards; s++) {
+    for (auto it = heaps[s].cbegin(); it != heaps[s].cend(); ++it) {
+      pushKBest(k, it->first, it->second, heap);
+    }
+  }
+}
+
+void Model::setScoringThreads(int32_t nthreads, int32_t threshold) {
+  scoringThreads_ = std::max(1, nthreads);
+  scoringThreshold_ = threshold;
 }
 
 void Model::dfs(int32_t k, int32_t node, real score,
@@ -180,21 +538,12 @@ void Model::dfs(int32_t k, int32_t node, real score,
   }
 
   if (tree[node].left == -1 && tree[node].right == -1) {
-    heap.push_back(std::make_pair(score, node));
-    std::push_heap(heap.begin(), heap.end(), comparePairs);
-    if (heap.size() > k) {
-      std::pop_heap(heap.begin(), heap.end(), comparePairs);
-      heap.pop_back();
-    }
+    pushKBest(k, score, node, heap);
     return;
   }
 
-  real f;
-  if (quant_ && args_->qout) {
-    f= sigmoid(qwo_->dotRow(hidden, node - osz_));
-  } else {
-    f= sigmoid(wo_->dotRow(hidden, node - osz_));
-  }
+  profileOutput(node - osz_);
+  real f = sigmoid(dotOutputRow(hidden, node - osz_));
 
   dfs(k, tree[node].left, score + log(1.0 - f), heap, hidden);
   dfs(k, tree[node].right, score + log(f), heap, hidden);
@@ -204,7 +553,8 @@ void Model::update(const std::vector<int32_t>& input, int32_t target, real lr) {
   assert(target >= 0);
   assert(target < osz_);
   if (input.size() == 0) return;
-  computeHidden(input, hidden_);
+  sampleProfile();
+  computeHidden(input);
   if (args_->loss == loss_name::ns) {
     loss_ += negativeSampling(target, lr);
   } else if (args_->loss == loss_name::hs) {
@@ -213,13 +563,110 @@ void Model::update(const std::vector<int32_t>& input, int32_t target, real lr) {
     loss_ += softmax(target, lr);
   }
   nexamples_ += 1;
+  updateInput(input);
+}
+
+void Model::update(const std::vector<int32_t>& input, const Vector& targets,
+                   real lr) {
+  assert(args_->loss == loss_name::softmax);
+  assert(targets.size() == osz_);
+  if (input.size() == 0) return;
+  sampleProfile();
+  computeHidden(input);
+  loss_ += softmax(targets, lr);
+  nexamples_ += 1;
+  updateInput(input);
+}
 
+// Negative sampling update of one input against several targets, sharing a
+// single set of negatives. All the output rows of the block are scored
+// before any of them is updated, and the gradient of the input is applied
+// once. The loss is the average of the per-target losses, each of which
+// counts every negative: the targets' gradients are divided by their number
+// while the negatives keep theirs, so no row moves by more than lr. Negatives
+// drawn among the targets are skipped rather than redrawn, since all the
+// labels may be targets.
+void Model::updateBlock(const std::vector<int32_t>& input,
+                        const std::vector<int32_t>& targets, real lr) {
+  assert(args_->loss == loss_name::ns);
+  if (input.size() == 0 || targets.size() == 0) return;
+  sampleProfile();
+  computeHidden(input);
+
+  blockRows_.assign(targets.cbegin(), targets.cend());
+  for (int32_t n = 0; n < args_->neg; n++) {
+    int32_t negative = getNegative(-1);
+    if (std::find(targets.cbegin(), targets.cend(), negative) ==
+        targets.cend()) {
+      blockRows_.push_back(negative);
+    }
+  }
+  blockScores_.resize(blockRows_.size());
+  for (int32_t i = 0; i < blockRows_.size(); i++) {
+    profileOutput(blockRows_[i]);
+    blockScores_[i] = sigmoid(wo_->dotRow(hidden_, blockRows_[i]));
+  }
+
+  const real scale = 1.0 / targets.size();
+  grad_.zero();
+  for (int32_t i = 0; i < blockRows_.size(); i++) {
+    const bool label = i < targets.size();
+    const real score = blockScores_[i];
+    real alpha = lr * (real(label) - score);
+    if (label) {
+      alpha *= scale;
+      loss_ -= scale * log(score);
+    } else {
+      loss_ -= log(1.0 - score);
+    }
+    grad_.addRow(*wo_, blockRows_[i], alpha);
+    updateOutputRow(hidden_, blockRows_[i], alpha);
+  }
+  nexamples_ += 1;
+  updateInput(input);
+}
+
+void Model::computeHidden(const std::vector<int32_t>& input) {
+  if (basis_) {
+    computeHidden(input, ihidden_);
+    hidden_.mul(*basis_, ihidden_);
+  } else {
+    computeHidden(input, hidden_);
+  }
+}
+
+// Backpropagates grad_ to the basis, if any, and to the input rows.
+void Model::updateInput(const std::vector<int32_t>& input) {
+  Vector& grad = basis_ ? igrad_ : grad_;
+  if (basis_) {
+    igrad_.zero();
+    for (int64_t i = 0; i < basis_->m_; i++) {
+      igrad_.addRow(*basis_, i, grad_[i]);
+      basis_->addRow(ihidden_, i, grad_[i]);
+    }
+  }
   if (args_->model == model_name::sup) {
-    grad_.mul(1.0 / input.size());
+    grad.mul(1.0 / input.size());
   }
   for (auto it = input.cbegin(); it != input.cend(); ++it) {
-    wi_->addRow(grad_, *it, 1.0);
+    updateInputRow(grad, *it);
+  }
+}
+
+// Estimated size of the tables and buffers of a model with osz outputs.
+int64_t Model::memoryUsage(const Args& args, int32_t osz) {
+  int64_t hsz = args.outputRank > 0 ? args.outputRank : args.dim;
+  int64_t size = (2 * hsz + 2 * args.dim + osz) * sizeof(real);
+  size += (SIGMOID_TABLE_SIZE + LOG_TABLE_SIZE + 2) * sizeof(real);
+  if (args.loss == loss_name::ns) {
+    size += int64_t(NEGATIVE_TABLE_SIZE) * sizeof(int32_t);
+  } else if (args.loss == loss_name::hs) {
+    int64_t depth = std::ceil(std::log2(std::max(2, osz)));
+    size += 2 * int64_t(osz) * sizeof(Node);
+    size += osz * (sizeof(std::vector<int32_t>) + sizeof(std::vector<bool>) +
+                   depth * sizeof(int32_t) + depth / 8 + 1);
   }
+  return size;
 }
 
 void Model::setTargetCounts(const std::vector<int64_t>& counts) {
@@ -10,6 +10,7 @@
 #ifndef FASTTEXT_MODEL_H
 #define FASTTEXT_MODEL_H
 
+#include <atomic>
 #include <vector>
 #include <random>
 #include <utility>
@@ -35,18 +36,66 @@ struct Node {
   bool binary;
 };
 
+// Access counts of the rows of the input and output matrices, recorded
+// for one call out of period to update or predict.
+class RowProfile {
+  private:
+    int32_t period_;
+    std::atomic<int64_t> samples_;
+    std::vector<std::atomic<uint32_t>> input_;
+    std::vector<std::atomic<uint32_t>> output_;
+
+  public:
+    RowProfile(int64_t, int64_t, int32_t);
+
+    int32_t period() const;
+    int64_t samples() const;
+    void addSample();
+    void addInput(int64_t);
+    void addOutput(int64_t);
+    std::vector<uint32_t> inputCounts() const;
+    std::vector<uint32_t> outputCounts() const;
+};
+
+// Sequence locks over stripes of the rows of a matrix, so that readers get
+// consistent rows while a single writer updates them. Readers retry when the
+// stripe of the row they read was written in the meantime.
+class RowLocks {
+  private:
+    std::vector<std::atomic<uint32_t>> seq_;
+
+  public:
+    explicit RowLocks(int32_t);
+
+    void beginWrite(int64_t);
+    void endWrite(int64_t);
+    uint32_t beginRead(int64_t) const;
+    bool endRead(int64_t, uint32_t) const;
+
+    static const int32_t DEFAULT_STRIPES = 4096;
+};
+
 class Model {
   private:
     std::shared_ptr<Matrix> wi_;
     std::shared_ptr<Matrix> wo_;
     std::shared_ptr<QMatrix> qwi_;
     std::shared_ptr<QMatrix> qwo_;
+    std::shared_ptr<Matrix> basis_;
     std::shared_ptr<Args> args_;
+    std::shared_ptr<RowProfile> profile_;
+    std::shared_ptr<RowLocks> inputLocks_;
+    std::shared_ptr<RowLocks> outputLocks_;
+    bool collapsed_;
     Vector hidden_;
     Vector output_;
     Vector grad_;
+    Vector ihidden_;
+    Vector igrad_;
     int32_t hsz_;
     int32_t osz_;
+    int32_t scoringThreads_;
+    int32_t scoringThreshold_;
     real loss_;
     int64_t nexamples_;
     real* t_sigmoid;
@@ -58,9 +107,28 @@ class Model {
     std::vector< std::vector<int32_t> > paths;
     std::vector< std::vector<bool> > codes;
     std::vector<Node> tree;
+    // used for shared negatives:
+    std::vector<int32_t> blockRows_;
+    std::vector<real> blockScores_;
 
     static bool comparePairs(const std::pair<real, int32_t>&,
                              const std::pair<real, int32_t>&);
+    static void pushKBest(int32_t, real, int32_t,
+                          std::vector<std::pair<real, int32_t>>&);
+    void findKBestParallel(int32_t, std::vector<std::pair<real, int32_t>>&,
+                           Vector&, Vector&) const;
+
+    bool sampleProfile() const;
+    void profileOutput(int32_t) const;
+    void profileAllOutputs() const;
+
+    void addInputRow(Vector&, int32_t) const;
+    real dotOutputRow(const Vector&, int32_t) const;
+    void updateInputRow(const Vector&, int32_t);
+    void updateOutputRow(const Vector&, int32_t, real);
+
+    void computeHidden(const std::vector<int32_t>&);
+    void updateInput(const std::vector<int32_t>&);
 
     int32_t getNegative(int32_t target);
     void initSigmoid();
@@ -77,22 +145,35 @@ class Model {
     real negativeSampling(int32_t, real);
     real hierarchicalSoftmax(int32_t, real);
     real softmax(int32_t, real);
+    real softmax(const Vector&, real);
 
     void predict(const std::vector<int32_t>&, int32_t,
                  std::vector<std::pair<real, int32_t>>&,
                  Vector&, Vector&) const;
     void predict(const std::vector<int32_t>&, int32_t,
                  std::vector<std::pair<real, int32_t>>&);
+    void predict(const std::vector<std::vector<int32_t>>&, int64_t, int64_t,
+                 int32_t, std::vector<std::vector<std::pair<real, int32_t>>>&,
+                 Vector&, Vector&) const;
+    void prefetchRows(const std::vector<int32_t>&) const;
+    void predictFromHidden(int32_t, std::vector<std::pair<real, int32_t>>&,
+                           Vector&, Vector&) const;
     void dfs(int32_t, int32_t, real,
              std::vector<std::pair<real, int32_t>>&,
              Vector&) const;
     void findKBest(int32_t, std::vector<std::pair<real, int32_t>>&,
                    Vector&, Vector&) const;
+    void setScoringThreads(int32_t, int32_t);
     void update(const std::vector<int32_t>&, int32_t, real);
+    void update(const std::vector<int32_t>&, const Vector&, real);
+    void updateBlock(const std::vector<int32_t>&, const std::vector<int32_t>&,
+                     real);
     void computeHidden(const std::vector<int32_t>&, Vector&) const;
     void computeOutputSoftmax(Vector&, Vector&) const;
     void computeOutputSoftmax();
 
+    static int64_t memoryUsage(const Args&, int32_t);
+
     void setTargetCounts(const std::vector<int64_t>&);
     void initTableNegatives(const std::vector<int64_t>&);
     void buildTree(const std::vector<int64_t>&);
@@ -103,6 +184,10 @@ class Model {
     std::minstd_rand rng;
     bool quant_;
     void setQuantizePointer(std::shared_ptr<QMatrix>, std::shared_ptr<QMatrix>, bool);
+    void setBasis(std::shared_ptr<Matrix>);
+    void setProfile(std::shared_ptr<RowProfile>);
+    void setLocks(std::shared_ptr<RowLocks>, std::shared_ptr<RowLocks>);
+    void setCollapsed(bool);
 };
 
 }
@@ -10,8 +10,11 @@
 #include "productquantizer.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 
+#include "threadpool.h"
+
 namespace fasttext {
 
 real distL2(const real* x, const real* y, int32_t d) {
@@ -40,6 +43,10 @@ real* ProductQuantizer::get_centroids(int32_t m, uint8_t i) {
   return &centroids_[(m * ksub_ + i) * dsub_];
 }
 
+void ProductQuantizer::set_batch_size(int32_t batch_size) {
+  batch_size_ = batch_size;
+}
+
 real ProductQuantizer::assign_centroid(const real * x, const real* c0,
                                        uint8_t* code, int32_t d) const {
   const real* c = c0;
@@ -56,18 +63,26 @@ real ProductQuantizer::assign_centroid(const real * x, const real* c0,
   return dis;
 }
 
-void ProductQuantizer::Estep(const real* x, const real* centroids,
-                             uint8_t* codes, int32_t d,
-                             int32_t n) const {
+double ProductQuantizer::Estep(const real* x, const real* centroids,
+                               uint8_t* codes, int32_t d,
+                               int32_t n) const {
+  std::vector<real> dists(n);
+  ThreadPool::global()->parallelFor(0, n, [&](int64_t begin, int64_t end) {
+    for (auto i = begin; i < end; i++) {
+      dists[i] = assign_centroid(x + i * d, centroids, codes + i, d);
+    }
+  }, 1024);
+  double distortion = 0.0;
   for (auto i = 0; i < n; i++) {
-    assign_centroid(x + i * d, centroids, codes + i, d);
+    distortion += dists[i];
   }
+  return distortion;
 }
 
 void ProductQuantizer::MStep(const real* x0, real* centroids,
                              const uint8_t* codes,
                              int32_t d, int32_t n) {
-  std::vector<int32_t> nelts(ksub_, 0);
+  std::vector<int64_t> nelts(ksub_, 0);
   memset(centroids, 0, sizeof(real) * d * ksub_);
   const real* x = x0;
   for (auto i = 0; i < n; i++) {
@@ -91,6 +106,15 @@ void ProductQuantizer::MStep(const real* x0, real* centroids,
     c += d;
   }
 
+  split_empty(centroids, nelts, n, d);
+}
+
+// Moves the centroids of empty clusters next to the centroid of a cluster
+// picked with a probability that grows with its size, and splits the
+// points of that cluster between the two. n is the total number of points.
+void ProductQuantizer::split_empty(real* centroids,
+                                   std::vector<int64_t>& nelts,
+                                   int64_t n, int32_t d) {
   std::uniform_real_distribution<> runiform(0,1);
   for (auto k = 0; k < ksub_; k++) {
     if (nelts[k] == 0) {
@@ -110,21 +134,107 @@ void ProductQuantizer::MStep(const real* x0, real* centroids,
   }
 }
 
-void ProductQuantizer::kmeans(const real *x, real* c, int32_t n, int32_t d) {
-  std::vector<int32_t> perm(n,0);
-  std::iota(perm.begin(), perm.end(), 0);
-  std::shuffle(perm.begin(), perm.end(), rng);
-  for (auto i = 0; i < ksub_; i++) {
-    memcpy (&c[i * d], x + perm[i] * d, d * sizeof(real));
+void ProductQuantizer::kmeanspp(const real* x, real* c, int32_t n,
+                                int32_t d) {
+  std::uniform_int_distribution<> uniform(0, n - 1);
+  memcpy(c, x + uniform(rng) * d, d * sizeof(real));
+  std::vector<real> dists(n);
+  for (auto i = 0; i < n; i++) {
+    dists[i] = distL2(x + i * d, c, d);
+  }
+  for (auto k = 1; k < ksub_; k++) {
+    double total = 0.0;
+    for (auto i = 0; i < n; i++) {
+      total += dists[i];
+    }
+    int32_t picked = n - 1;
+    if (total > 0) {
+      std::uniform_real_distribution<> runiform(0, total);
+      double r = runiform(rng);
+      for (auto i = 0; i < n; i++) {
+        r -= dists[i];
+        if (r < 0) {
+          picked = i;
+          break;
+        }
+      }
+    } else {
+      picked = uniform(rng);
+    }
+    real* ck = c + k * d;
+    memcpy(ck, x + picked * d, d * sizeof(real));
+    ThreadPool::global()->parallelFor(0, n, [&](int64_t begin, int64_t end) {
+      for (auto i = begin; i < end; i++) {
+        dists[i] = std::min(dists[i], distL2(x + i * d, ck, d));
+      }
+    }, 1024);
   }
+}
+
+void ProductQuantizer::kmeans(const real *x, real* c, int32_t n, int32_t d) {
+  kmeanspp(x, c, n, d);
   uint8_t* codes = new uint8_t[n];
+  double prev = 0.0;
   for (auto i = 0; i < niter_; i++) {
-    Estep(x, c, codes, d, n);
+    double distortion = Estep(x, c, codes, d, n);
+    if (i > 0 && prev - distortion <= tol_ * prev) {
+      break;
+    }
+    prev = distortion;
     MStep(x, c, codes, d, n);
   }
   delete [] codes;
 }
 
+// Mini-batch k-means over the n sub-vectors of dimension d starting at x,
+// in rows of dim_ values: the batches are sampled from all the rows, and
+// the centroids c must already be initialized. Clusters left empty are
+// reseeded as in kmeans once the batches have seen enough points.
+void ProductQuantizer::minibatch_kmeans(const real *x, real* c, int32_t n,
+                                        int32_t d) {
+  std::vector<int64_t> counts(ksub_, 0);
+  std::uniform_int_distribution<> uniform(0, n - 1);
+  const int32_t batch = std::min(batch_size_, n);
+  const int64_t nbatches = std::max<int64_t>(
+      niter_, int64_t(niter_) * max_points_ / batch);
+  std::vector<int32_t> samples(batch);
+  std::vector<uint8_t> codes(batch);
+  int64_t total = 0;
+  double smoothed = 0.0;
+  for (int64_t it = 0; it < nbatches; it++) {
+    double distortion = 0.0;
+    for (auto i = 0; i < batch; i++) {
+      samples[i] = uniform(rng);
+      distortion += assign_centroid(x + samples[i] * dim_, c, &codes[i], d);
+    }
+    for (auto i = 0; i < batch; i++) {
+      real* ck = c + codes[i] * d;
+      real eta = 1.0 / ++counts[codes[i]];
+      const real* xi = x + samples[i] * dim_;
+      for (auto j = 0; j < d; j++) {
+        ck[j] += eta * (xi[j] - ck[j]);
+      }
+    }
+    total += batch;
+    if (total > ksub_) {
+      split_empty(c, counts, total, d);
+    }
+    distortion /= batch;
+    if (it == 0) {
+      smoothed = distortion;
+      continue;
+    }
+    double next = 0.9 * smoothed + 0.1 * distortion;
+    if (it >= niter_ && std::abs(smoothed - next) <= tol_ * smoothed) {
+      break;
+    }
+    smoothed = next;
+  }
+}
+
+// The centroids are initialized on a sample of at most max_points_ rows.
+// Full-batch k-means runs on that sample, while mini-batches are drawn
+// from all the rows of x.
 void ProductQuantizer::train(int32_t n, const real * x) {
   if (n < ksub_) {
     std::cerr<<"Matrix too small for quantization, must have > 256 rows"<<std::endl;
@@ -137,11 +247,18 @@ void ProductQuantizer::train(int32_t n, const real * x) {
   real* xslice = new real[np * dsub_];
   for (auto m = 0; m < nsubq_; m++) {
     if (m == nsubq_-1) {d = lastdsub_;}
-    if (np != n) {std::shuffle(perm.begin(), perm.end(), rng);}
+    if (np != n) {
+      std::shuffle(perm.begin(), perm.end(), rng);
+    }
     for (auto j = 0; j < np; j++) {
       memcpy (xslice + j * d, x + perm[j] * dim_ + m * dsub_, d * sizeof(real));
     }
-    kmeans(xslice, get_centroids(m, 0), np, d);
+    if (batch_size_ > 0) {
+      kmeanspp(xslice, get_centroids(m, 0), np, d);
+      minibatch_kmeans(x + m * dsub_, get_centroids(m, 0), n, d);
+    } else {
+      kmeans(xslice, get_centroids(m, 0), np, d);
+    }
   }
   delete [] xslice;
 }
@@ -161,6 +278,38 @@ real ProductQuantizer::mulcode(const Vector& x, const uint8_t* codes,
   return res * alpha;
 }
 
+// Dot products of each sub-vector of x with all the centroids of its
+// sub-quantizer, so that the dot product of x with a code costs one lookup
+// per sub-quantizer.
+void ProductQuantizer::compute_table(const Vector& x, real* table) const {
+  auto d = dsub_;
+  for (auto m = 0; m < nsubq_; m++) {
+    if (m == nsubq_ - 1) {d = lastdsub_;}
+    for (auto i = 0; i < ksub_; i++) {
+      const real* c = get_centroids(m, i);
+      real dp = 0.0;
+      for (auto n = 0; n < d; n++) {
+        dp += x[m * dsub_ + n] * c[n];
+      }
+      table[m * ksub_ + i] = dp;
+    }
+  }
+}
+
+real ProductQuantizer::mulcode(const real* table, const uint8_t* codes,
+                               int32_t t, real alpha) const {
+  real res = 0.0;
+  const uint8_t* code = codes + nsubq_ * t;
+  for (auto m = 0; m < nsubq_; m++) {
+    res += table[m * ksub_ + code[m]];
+  }
+  return res * alpha;
+}
+
+int32_t ProductQuantizer::table_size() const {
+  return nsubq_ * ksub_;
+}
+
 void ProductQuantizer::addcode(Vector& x, const uint8_t* codes,
                                int32_t t, real alpha) const {
   auto d = dsub_;
@@ -184,9 +333,11 @@ void ProductQuantizer::compute_code(const real* x, uint8_t* code) const {
 
 void ProductQuantizer::compute_codes(const real* x, uint8_t* codes,
                                      int32_t n) const {
-  for (auto i = 0; i < n; i++) {
-    compute_code(x + i * dim_, codes + i * nsubq_);
-  }
+  ThreadPool::global()->parallelFor(0, n, [&](int64_t begin, int64_t end) {
+    for (auto i = begin; i < end; i++) {
+      compute_code(x + i * dim_, codes + i * nsubq_);
+    }
+  }, 1024);
 }
 
 void ProductQuantizer::save(std::ostream& out) {
@@ -30,6 +30,9 @@ class ProductQuantizer {
     const int32_t seed_ = 1234;
     const int32_t niter_ = 25;
     const real eps_ = 1e-7;
+    const real tol_ = 1e-3;
+
+    int32_t batch_size_ = 0;
 
     int32_t dim_;
     int32_t nsubq_;
@@ -47,13 +50,21 @@ class ProductQuantizer {
     real* get_centroids (int32_t, uint8_t);
     const real* get_centroids(int32_t, uint8_t) const;
 
+    void set_batch_size(int32_t);
+
     real assign_centroid(const real*, const real*, uint8_t*, int32_t) const;
-    void Estep(const real*, const real*, uint8_t*, int32_t, int32_t) const;
+    double Estep(const real*, const real*, uint8_t*, int32_t, int32_t) const;
     void MStep(const real*, real*, const uint8_t*, int32_t, int32_t);
+    void split_empty(real*, std::vector<int64_t>&, int64_t, int32_t);
+    void kmeanspp(const real*, real*, int32_t, int32_t);
     void kmeans(const real*, real*, int32_t, int32_t);
+    void minibatch_kmeans(const real*, real*, int32_t, int32_t);
     void train(int, const real*);
 
     real mulcode(const Vector&, const uint8_t*, int32_t, real) const;
+    real mulcode(const real*, const uint8_t*, int32_t, real) const;
+    void compute_table(const Vector&, real*) const;
+    int32_t table_size() const;
     void addcode(Vector&, const uint8_t*, int32_t, real) const;
     void compute_code(const real*, uint8_t*)  const;
     void compute_codes(const real*, uint8_t*, int32_t)  const;
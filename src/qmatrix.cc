@@ -12,21 +12,32 @@
 #include <assert.h>
 #include <iostream>
 
+#include "utils.h"
+
 namespace fasttext {
 
-QMatrix::QMatrix() : qnorm_(false),
-  m_(0), n_(0), codesize_(0) {}
+QMatrix::QMatrix() : qnorm_(false), residual_(false),
+  m_(0), n_(0), codesize_(0), rcodesize_(0) {}
 
-QMatrix::QMatrix(const Matrix& mat, int32_t dsub, bool qnorm)
-      : qnorm_(qnorm), m_(mat.m_), n_(mat.n_),
-        codesize_(m_ * ((n_ + dsub - 1) / dsub)) {
+QMatrix::QMatrix(const Matrix& mat, int32_t dsub, bool qnorm, int32_t batch,
+                 int32_t rdsub)
+      : qnorm_(qnorm), residual_(rdsub > 0), m_(mat.m_), n_(mat.n_),
+        codesize_(m_ * ((n_ + dsub - 1) / dsub)), rcodesize_(0) {
   if (codesize_ > 0) {
     codes_ = new uint8_t[codesize_];
   }
   pq_ = std::unique_ptr<ProductQuantizer>( new ProductQuantizer(n_, dsub));
+  pq_->set_batch_size(batch);
   if (qnorm_) {
     norm_codes_ = new uint8_t[m_];
     npq_ = std::unique_ptr<ProductQuantizer>( new ProductQuantizer(1, 1));
+    npq_->set_batch_size(batch);
+  }
+  if (residual_) {
+    rcodesize_ = m_ * ((n_ + rdsub - 1) / rdsub);
+    rcodes_ = new uint8_t[rcodesize_];
+    rpq_ = std::unique_ptr<ProductQuantizer>( new ProductQuantizer(n_, rdsub));
+    rpq_->set_batch_size(batch);
   }
   quantize(mat);
 }
@@ -36,6 +47,7 @@ QMatrix::~QMatrix() {
     delete[] codes_;
   }
   if (qnorm_) { delete[] norm_codes_; }
+  if (residual_) { delete[] rcodes_; }
 }
 
 void QMatrix::quantizeNorm(const Vector& norms) {
@@ -59,6 +71,18 @@ void QMatrix::quantize(const Matrix& matrix) {
   auto dataptr = temp.data_;
   pq_->train(m_, dataptr);
   pq_->compute_codes(dataptr, codes_, m_);
+  if (residual_) {
+    Vector row(n_);
+    for (int64_t i = 0; i < m_; i++) {
+      row.zero();
+      pq_->addcode(row, codes_, i, 1.0);
+      for (int64_t j = 0; j < n_; j++) {
+        temp.at(i, j) -= row[j];
+      }
+    }
+    rpq_->train(m_, dataptr);
+    rpq_->compute_codes(dataptr, rcodes_, m_);
+  }
 }
 
 void QMatrix::addToVector(Vector& x, int32_t t) const {
@@ -67,6 +91,9 @@ void QMatrix::addToVector(Vector& x, int32_t t) const {
     norm = npq_->get_centroids(0, norm_codes_[t])[0];
   }
   pq_->addcode(x, codes_, t, norm);
+  if (residual_) {
+    rpq_->addcode(x, rcodes_, t, norm);
+  }
 }
 
 real QMatrix::dotRow(const Vector& vec, int64_t i) const {
@@ -77,7 +104,36 @@ real QMatrix::dotRow(const Vector& vec, int64_t i) const {
   if (qnorm_) {
     norm = npq_->get_centroids(0, norm_codes_[i])[0];
   }
-  return pq_->mulcode(vec, codes_, i, norm);
+  real d = pq_->mulcode(vec, codes_, i, norm);
+  if (residual_) {
+    d += rpq_->mulcode(vec, rcodes_, i, norm);
+  }
+  return d;
+}
+
+// Asymmetric distance tables of vec, see ProductQuantizer::compute_table.
+void QMatrix::computeTables(const Vector& vec, std::vector<real>& tables) const {
+  assert(vec.size() == n_);
+  int32_t size = pq_->table_size();
+  tables.resize(size + (residual_ ? rpq_->table_size() : 0));
+  pq_->compute_table(vec, tables.data());
+  if (residual_) {
+    rpq_->compute_table(vec, tables.data() + size);
+  }
+}
+
+real QMatrix::dotRow(const std::vector<real>& tables, int64_t i) const {
+  assert(i >= 0);
+  assert(i < m_);
+  real norm = 1;
+  if (qnorm_) {
+    norm = npq_->get_centroids(0, norm_codes_[i])[0];
+  }
+  real d = pq_->mulcode(tables.data(), codes_, i, norm);
+  if (residual_) {
+    d += rpq_->mulcode(tables.data() + pq_->table_size(), rcodes_, i, norm);
+  }
+  return d;
 }
 
 int64_t QMatrix::getM() const {
@@ -88,6 +144,42 @@ int64_t QMatrix::getN() const {
   return n_;
 }
 
+int64_t QMatrix::size() const {
+  int64_t size = codesize_ + rcodesize_;
+  if (qnorm_) {
+    size += m_;
+  }
+  return size;
+}
+
+bool QMatrix::lock() const {
+  bool locked = utils::lock(codes_, codesize_);
+  if (qnorm_) {
+    locked &= utils::lock(norm_codes_, m_);
+  }
+  if (residual_) {
+    locked &= utils::lock(rcodes_, rcodesize_);
+  }
+  return locked;
+}
+
+real QMatrix::relativeError(const Matrix& mat) const {
+  assert(mat.m_ == m_);
+  assert(mat.n_ == n_);
+  Vector row(n_);
+  double err = 0.0, total = 0.0;
+  for (int64_t i = 0; i < m_; i++) {
+    row.zero();
+    addToVector(row, i);
+    for (int64_t j = 0; j < n_; j++) {
+      real diff = mat.at(i, j) - row[j];
+      err += diff * diff;
+      total += mat.at(i, j) * mat.at(i, j);
+    }
+  }
+  return (total > 0) ? err / total : 0.0;
+}
+
 void QMatrix::save(std::ostream& out) {
     out.write((char*) &qnorm_, sizeof(qnorm_));
     out.write((char*) &m_, sizeof(m_));
@@ -99,9 +191,15 @@ void QMatrix::save(std::ostream& out) {
       out.write((char*) norm_codes_, m_ * sizeof(uint8_t));
       npq_->save(out);
     }
+    out.write((char*) &residual_, sizeof(residual_));
+    if (residual_) {
+      out.write((char*) &rcodesize_, sizeof(rcodesize_));
+      out.write((char*) rcodes_, rcodesize_ * sizeof(uint8_t));
+      rpq_->save(out);
+    }
 }
 
-void QMatrix::load(std::istream& in) {
+void QMatrix::load(std::istream& in, int32_t version) {
     in.read((char*) &qnorm_, sizeof(qnorm_));
     in.read((char*) &m_, sizeof(m_));
     in.read((char*) &n_, sizeof(n_));
@@ -116,6 +214,17 @@ void QMatrix::load(std::istream& in) {
       npq_ = std::unique_ptr<ProductQuantizer>( new ProductQuantizer());
       npq_->load(in);
     }
+    residual_ = false;
+    if (version > 11) {
+      in.read((char*) &residual_, sizeof(residual_));
+    }
+    if (residual_) {
+      in.read((char*) &rcodesize_, sizeof(rcodesize_));
+      rcodes_ = new uint8_t[rcodesize_];
+      in.read((char*) rcodes_, rcodesize_ * sizeof(uint8_t));
+      rpq_ = std::unique_ptr<ProductQuantizer>( new ProductQuantizer());
+      rpq_->load(in);
+    }
 }
 
 }
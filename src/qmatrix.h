@@ -30,34 +30,43 @@ class QMatrix {
   private:
     std::unique_ptr<ProductQuantizer> pq_;
     std::unique_ptr<ProductQuantizer> npq_;
+    std::unique_ptr<ProductQuantizer> rpq_;
 
     uint8_t* codes_;
     uint8_t* norm_codes_;
+    uint8_t* rcodes_;
 
     bool qnorm_;
+    bool residual_;
 
     int64_t m_;
     int64_t n_;
 
     int32_t codesize_;
+    int32_t rcodesize_;
 
   public:
 
     QMatrix();
-    QMatrix(const Matrix&, int32_t, bool);
+    QMatrix(const Matrix&, int32_t, bool, int32_t, int32_t);
     ~QMatrix();
 
     int64_t getM() const;
     int64_t getN() const;
+    int64_t size() const;
+    real relativeError(const Matrix&) const;
+    bool lock() const;
 
     void quantizeNorm(const Vector&);
     void quantize(const Matrix&);
 
     void addToVector(Vector& x, int32_t t) const;
     real dotRow(const Vector&, int64_t) const;
+    void computeTables(const Vector&, std::vector<real>&) const;
+    real dotRow(const std::vector<real>&, int64_t) const;
 
     void save(std::ostream&);
-    void load(std::istream&);
+    void load(std::istream&, int32_t);
 };
 
 }
@@ -0,0 +1,226 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "threadpool.h"
+
+#include <algorithm>
+
+namespace fasttext {
+
+namespace {
+
+thread_local const ThreadPool* currentPool = nullptr;
+thread_local int32_t currentQueue = -1;
+
+std::mutex globalMutex;
+
+// Never destroyed: exit may be called from a task, and joining the
+// workers from one of them would fail.
+std::shared_ptr<ThreadPool>& globalPool() {
+  static std::shared_ptr<ThreadPool>* pool = new std::shared_ptr<ThreadPool>();
+  return *pool;
+}
+
+}
+
+TaskGroup::TaskGroup(std::shared_ptr<ThreadPool> pool)
+  : pool_(pool), pending_(0) {}
+
+TaskGroup::~TaskGroup() {
+  wait();
+}
+
+void TaskGroup::run(std::function<void()> task) {
+  pending_++;
+  pool_->push(task, this);
+}
+
+void TaskGroup::wait() {
+  const int32_t self = pool_->self();
+  while (pending_ > 0) {
+    if (pool_->runTask(self)) continue;
+    std::unique_lock<std::mutex> lock(pool_->mutex_);
+    pool_->cv_.wait(lock, [this]() {
+      return pending_ == 0 || pool_->queued_ > 0;
+    });
+  }
+}
+
+ThreadPool::ThreadPool(int32_t size) : queued_(0), stop_(false) {
+  size = std::max(1, size);
+  for (int32_t i = 0; i < size; i++) {
+    queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+  }
+  for (int32_t i = 0; i < size - 1; i++) {
+    workers_.push_back(std::thread([this, i]() { work(i); }));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto it = workers_.begin(); it != workers_.end(); ++it) {
+    it->join();
+  }
+}
+
+int32_t ThreadPool::size() const {
+  return queues_.size();
+}
+
+// Workers use their own queue, other threads the last one.
+int32_t ThreadPool::self() const {
+  return currentPool == this ? currentQueue : queues_.size() - 1;
+}
+
+void ThreadPool::push(std::function<void()> task, TaskGroup* group) {
+  Queue& queue = *queues_[self()];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::make_pair(task, group));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_++;
+  }
+  cv_.notify_one();
+}
+
+bool ThreadPool::runTask(int32_t self) {
+  std::pair<std::function<void()>, TaskGroup*> task;
+  bool found = false;
+  const int32_t n = queues_.size();
+  for (int32_t i = 0; i < n && !found; i++) {
+    Queue& queue = *queues_[(self + i) % n];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) continue;
+    if (i == 0) {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+    } else {
+      task = queue.tasks.front();
+      queue.tasks.pop_front();
+    }
+    found = true;
+  }
+  if (!found) {
+    return false;
+  }
+  queued_--;
+  task.first();
+  // Release what the task captured before its group may be destroyed.
+  task.first = nullptr;
+  finish(task.second);
+  return true;
+}
+
+void ThreadPool::finish(TaskGroup* group) {
+  if (--group->pending_ == 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_all();
+  }
+}
+
+void ThreadPool::work(int32_t i) {
+  currentPool = this;
+  currentQueue = i;
+  while (true) {
+    if (runTask(i)) continue;
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+    if (stop_ && queued_ == 0) {
+      return;
+    }
+  }
+}
+
+// Calls f on contiguous subranges of [begin, end) of at least grain
+// elements. The calling thread processes the first subrange.
+void ThreadPool::parallelFor(int64_t begin, int64_t end,
+                             const std::function<void(int64_t, int64_t)>& f,
+                             int64_t grain) {
+  const int64_t n = end - begin;
+  if (n <= 0) {
+    return;
+  }
+  const int64_t nchunks = std::max<int64_t>(1, std::min<int64_t>(
+      std::min<int64_t>(n, 4 * size()), n / std::max<int64_t>(grain, 1)));
+  if (nchunks == 1) {
+    f(begin, end);
+    return;
+  }
+  TaskGroup group(shared_from_this());
+  for (int64_t c = nchunks - 1; c > 0; c--) {
+    const int64_t b = begin + c * n / nchunks;
+    const int64_t e = begin + (c + 1) * n / nchunks;
+    group.run([&f, b, e]() { f(b, e); });
+  }
+  f(begin, begin + n / nchunks);
+  group.wait();
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::global() {
+  std::lock_guard<std::mutex> lock(globalMutex);
+  if (!globalPool()) {
+    globalPool() = std::make_shared<ThreadPool>(
+        std::max(1u, std::thread::hardware_concurrency()));
+  }
+  return globalPool();
+}
+
+// Calls read(slot) on the calling thread for successive items until it
+// returns false, process(slot) on each item as a task of the pool, and
+// write(slot) on the calling thread in the order the items were read.
+// Items go through depth slots, so that reading and writing overlap with
+// processing of the depth - 1 items before.
+void ThreadPool::pipeline(const std::function<bool(int32_t)>& read,
+                          const std::function<void(int32_t)>& process,
+                          const std::function<void(int32_t)>& write,
+                          int32_t depth) {
+  depth = std::max(1, depth);
+  std::vector<std::unique_ptr<TaskGroup>> slots;
+  for (int32_t i = 0; i < depth; i++) {
+    slots.push_back(std::unique_ptr<TaskGroup>(
+        new TaskGroup(shared_from_this())));
+  }
+  int64_t head = 0, tail = 0;
+  while (true) {
+    if (tail - head == depth) {
+      const int32_t slot = head++ % depth;
+      slots[slot]->wait();
+      write(slot);
+    }
+    const int32_t slot = tail % depth;
+    if (!read(slot)) {
+      break;
+    }
+    slots[slot]->run([&process, slot]() { process(slot); });
+    tail++;
+  }
+  for (; head < tail; head++) {
+    const int32_t slot = head % depth;
+    slots[slot]->wait();
+    write(slot);
+  }
+}
+
+// Replaces the global pool. Task groups and other holders of the previous
+// pool share its ownership: it is destroyed, joining its workers, once the
+// last of them releases it.
+void ThreadPool::setGlobalThreads(int32_t size) {
+  std::lock_guard<std::mutex> lock(globalMutex);
+  if (!globalPool() || globalPool()->size() != std::max(1, size)) {
+    globalPool() = std::make_shared<ThreadPool>(size);
+  }
+}
+
+}
@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#ifndef FASTTEXT_THREADPOOL_H
+#define FASTTEXT_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fasttext {
+
+class ThreadPool;
+
+// A set of tasks that can be waited for together. The waiting thread
+// runs pending tasks of the pool until all the tasks of the group are
+// done, so groups can be nested inside tasks. The group shares ownership
+// of its pool, which thus outlives the tasks even if it is replaced as
+// the global pool meanwhile.
+class TaskGroup {
+  private:
+    std::shared_ptr<ThreadPool> pool_;
+    std::atomic<int64_t> pending_;
+
+  public:
+    explicit TaskGroup(std::shared_ptr<ThreadPool>);
+    ~TaskGroup();
+
+    void run(std::function<void()>);
+    void wait();
+
+    friend class ThreadPool;
+};
+
+// Work-stealing pool: every worker has its own queue and takes tasks from
+// the back of it, or from the front of the queues of the other workers
+// when it is empty. Threads that are not part of the pool share one more
+// queue. A pool of size n has n - 1 workers, the caller being the last.
+class ThreadPool : public std::enable_shared_from_this<ThreadPool> {
+  private:
+    struct Queue {
+      std::mutex mutex;
+      std::deque<std::pair<std::function<void()>, TaskGroup*>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<int64_t> queued_;
+    bool stop_;
+
+    int32_t self() const;
+    void push(std::function<void()>, TaskGroup*);
+    bool runTask(int32_t);
+    void finish(TaskGroup*);
+    void work(int32_t);
+
+  public:
+    explicit ThreadPool(int32_t);
+    ~ThreadPool();
+
+    int32_t size() const;
+    void parallelFor(int64_t, int64_t,
+                     const std::function<void(int64_t, int64_t)>&,
+                     int64_t grain = 1);
+    void pipeline(const std::function<bool(int32_t)>&,
+                  const std::function<void(int32_t)>&,
+                  const std::function<void(int32_t)>&,
+                  int32_t depth = 2);
+
+    static std::shared_ptr<ThreadPool> global();
+    static void setGlobalThreads(int32_t);
+
+    friend class TaskGroup;
+};
+
+}
+
+#endif
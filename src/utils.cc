@@ -9,6 +9,13 @@
 
 #include "utils.h"
 
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cmath>
 #include <ios>
 
 namespace fasttext {
@@ -24,6 +31,140 @@ namespace utils {
     ifs.clear();
     ifs.seekg(std::streampos(pos));
   }
+
+  // Locks the pages of [addr, addr + size) in memory. Returns false if
+  // locking failed.
+  bool lock(const void* addr, int64_t size) {
+    if (size <= 0) {
+      return true;
+    }
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t begin = (uintptr_t) addr & ~(page - 1);
+    const uintptr_t end = (uintptr_t) addr + size;
+    return mlock((const void*) begin, end - begin) == 0;
+  }
+
+  typedef unsigned __int128 uint128;
+
+  uint128 pow10(int32_t e) {
+    uint128 p = 1;
+    while (e-- > 0) {
+      p *= 10;
+    }
+    return p;
+  }
+
+  // Scales m * 2^e by 10^s and splits the result into an integer quotient
+  // and the remainder over the common denominator. Returns false if the
+  // exact computation does not fit in 128 bits.
+  bool scale(uint64_t m, int32_t e, int32_t s,
+             uint64_t& q, uint128& r, uint128& d) {
+    int32_t nbits = 24 + std::max(e, 0) + 4 * std::max(s, 0);
+    int32_t dbits = std::max(-e, 0) + 4 * std::max(-s, 0);
+    if (nbits > 124 || dbits > 124) {
+      return false;
+    }
+    uint128 n = uint128(m) << std::max(e, 0);
+    n *= pow10(std::max(s, 0));
+    d = uint128(1) << std::max(-e, 0);
+    d *= pow10(std::max(-s, 0));
+    q = n / d;
+    r = n % d;
+    return true;
+  }
+
+  // Writes x to buf exactly as printf("%.*g", precision, x) would, without
+  // going through the locale machinery of iostreams. buf must hold at least
+  // 32 characters. Returns the number of characters written.
+  int32_t formatReal(char* buf, real x, int32_t precision) {
+    if (!std::isfinite(x) || sizeof(real) != sizeof(uint32_t) ||
+        precision < 1 || precision > 9) {
+      return snprintf(buf, 32, "%.*g", precision, x);
+    }
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    char* p = buf;
+    if (bits >> 31) {
+      *p++ = '-';
+    }
+    uint32_t ebits = (bits >> 23) & 0xff;
+    uint64_t m = bits & 0x7fffff;
+    if (ebits == 0 && m == 0) {
+      *p++ = '0';
+      return p - buf;
+    }
+    int32_t e = -149;
+    if (ebits != 0) {
+      m |= 0x800000;
+      e = ebits - 150;
+    }
+    const uint64_t lo = pow10(precision - 1), hi = lo * 10;
+    int32_t exp10 = std::floor(std::log10(double(m)) + e * std::log10(2.0));
+    uint64_t q;
+    uint128 r, d;
+    for (int32_t tries = 0; ; tries++) {
+      if (tries > 2 || !scale(m, e, precision - 1 - exp10, q, r, d)) {
+        return snprintf(buf, 32, "%.*g", precision, x);
+      }
+      if (q < lo) {
+        exp10--;
+      } else if (q >= hi) {
+        exp10++;
+      } else {
+        break;
+      }
+    }
+    if (2 * r > d || (2 * r == d && (q & 1))) {
+      q++;
+    }
+    if (q == hi) {
+      q = lo;
+      exp10++;
+    }
+    char digits[10];
+    int32_t ndigits = precision;
+    for (int32_t i = precision - 1; i >= 0; i--) {
+      digits[i] = '0' + q % 10;
+      q /= 10;
+    }
+    while (ndigits > 1 && digits[ndigits - 1] == '0') {
+      ndigits--;
+    }
+    if (exp10 < -4 || exp10 >= precision) {
+      *p++ = digits[0];
+      if (ndigits > 1) {
+        *p++ = '.';
+        memcpy(p, digits + 1, ndigits - 1);
+        p += ndigits - 1;
+      }
+      *p++ = 'e';
+      *p++ = (exp10 < 0) ? '-' : '+';
+      int32_t a = std::abs(exp10);
+      if (a >= 100) {
+        *p++ = '0' + a / 100;
+      }
+      *p++ = '0' + (a / 10) % 10;
+      *p++ = '0' + a % 10;
+    } else if (exp10 >= 0) {
+      for (int32_t i = 0; i <= exp10; i++) {
+        *p++ = (i < ndigits) ? digits[i] : '0';
+      }
+      if (ndigits > exp10 + 1) {
+        *p++ = '.';
+        memcpy(p, digits + exp10 + 1, ndigits - exp10 - 1);
+        p += ndigits - exp10 - 1;
+      }
+    } else {
+      *p++ = '0';
+      *p++ = '.';
+      for (int32_t i = 0; i < -exp10 - 1; i++) {
+        *p++ = '0';
+      }
+      memcpy(p, digits, ndigits);
+      p += ndigits;
+    }
+    return p - buf;
+  }
 }
 
 }
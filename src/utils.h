@@ -12,12 +12,16 @@
 
 #include <fstream>
 
+#include "real.h"
+
 namespace fasttext {
 
 namespace utils {
 
   int64_t size(std::ifstream&);
   void seek(std::ifstream&, int64_t);
+  int32_t formatReal(char*, real, int32_t);
+  bool lock(const void*, int64_t);
 }
 
 }
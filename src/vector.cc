@@ -13,9 +13,11 @@
 
 #include <iomanip>
 #include <cmath>
+#include <string>
 
 #include "matrix.h"
 #include "qmatrix.h"
+#include "utils.h"
 
 namespace fasttext {
 
@@ -125,12 +127,20 @@ const real& Vector::operator[](int64_t i) const {
   return data_[i];
 }
 
+void Vector::print(std::ostream& os, int32_t precision) const {
+  std::string buffer(m_ * 33, ' ');
+  char* p = &buffer[0];
+  for (int64_t j = 0; j < m_; j++) {
+    p += utils::formatReal(p, data_[j], precision);
+    *p++ = ' ';
+  }
+  os.write(buffer.data(), p - buffer.data());
+}
+
 std::ostream& operator<<(std::ostream& os, const Vector& v)
 {
   os << std::setprecision(5);
-  for (int64_t j = 0; j < v.m_; j++) {
-    os << v.data_[j] << ' ';
-  }
+  v.print(os, 5);
   return os;
 }
 
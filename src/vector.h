@@ -44,6 +44,7 @@ class Vector {
     void mul(const QMatrix&, const Vector&);
     void mul(const Matrix&, const Vector&);
     int64_t argmax();
+    void print(std::ostream&, int32_t) const;
 };
 
 std::ostream& operator<<(std::ostream&, const Vector&);